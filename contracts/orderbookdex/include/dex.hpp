@@ -15,13 +15,15 @@ public:
 
 public:
     dex_contract(name receiver, name code, datastream<const char *> ds)
-        : contract(receiver, code, ds), _conf_tbl(get_self(), get_self().value),
-          _global(dex::global_state::make_global(get_self())) {
-        _config = _conf_tbl.exists() ? _conf_tbl.get() : get_default_config();
-    }
+        : contract(receiver, code, ds), _conf_tbl(get_self(), get_self().value), _pair_seqs(get_self()) {}
 
     ~dex_contract() {
-        _global->save(get_self());
+        // the global state is saved only if it is loaded and changed by this action
+        if (_global) _global->save(get_self());
+        _pair_seqs.save(get_self());
+        if (_balance_log_head) {
+            dex::balance_log_head_table(get_self(), get_self().value).set(*_balance_log_head, get_self());
+        }
     }
 
     ACTION init();
@@ -37,6 +39,14 @@ public:
 
     ACTION delsympair(const uint64_t& sympair_id);
 
+    /**
+     * fund a queued order of user, or place a new order directly by memo:
+     *   queue:<queue_order_id>  - fund the indicated queued order
+     *   order:<sympair_id>:<side>:<quantity>:<price>:<ext_id>[:<time_in_force>]  - place a new order
+     *   market:<sympair_id>:<side>:<ext_id>  - match a market order at once, the quantity is the budget
+     *   amend:<sympair_id>:<side>:<order_id>:<remaining_quant>:<price>  - amend a resting order with more frozen funds
+     *   other memo - fund the earliest queued order of user
+     */
     [[eosio::on_notify("*::transfer")]] 
     void ontransfer(const name& from, const name& to, const asset& quant, const string& memo);
 
@@ -51,12 +61,22 @@ public:
      * @param price - the price
      * @param ext_id - external id, always set by application
      * @param order_config_ex - optional extended config, must authenticate by admin if set
+     * @param time_in_force - gtc | ioc | fok | postonly, see order_tif. gtc if empty or not sent,
+     *                        it is appended to the deployed action, so the old clients still work
      */
     ACTION neworder(const name &user, const uint64_t &sympair_id,
             const name &order_side,
              const asset &total_asset_quant,
              const asset &price, const uint64_t &ext_id,
-             const optional<dex::order_config_ex_t> &order_config_ex);
+             const optional<dex::order_config_ex_t> &order_config_ex,
+             const binary_extension<name> &time_in_force);
+
+    /**
+     * create new orders in batch, the orders are queued in turn and funded by transfers in the same order
+     * @param user - user, owner of orders
+     * @param orders - the order params, at most DEX_BATCH_ORDERS_MAX orders
+     */
+    ACTION neworders(const name &user, const vector<dex::order_param_t> &orders);
 
 
     /**
@@ -76,34 +96,115 @@ public:
                 const uint64_t &ext_id);
 
     /**
+     *  match the crossed orders of symbol pair, and save the progress to the match cursor of pair.
+     *  the partial filled orders are saved at the end of each call, so that the next call resumes
+     *  from the top of order book, where the last call stopped.
      *  @param max_count the max count of match item
      *  @param sym_pairs the symol pairs to match. is empty, match all
      */
     ACTION match(const name &matcher, const uint64_t& pair_id, uint32_t max_count, const string &memo);
 
+    /**
+     *  match the crossed pairs in pair_ids with one budget, the pairs not crossed are skipped.
+     *  the budget is shared equally by the crossed pairs in rounds, the least recently matched pair first.
+     *  @param pair_ids - the symbol pairs to match
+     *  @param total_budget - the max count of match items of all pairs
+     */
+    ACTION matchmany(const name &matcher, const vector<uint64_t>& pair_ids, uint32_t total_budget, const string &memo);
+
+    /**
+     * prune the deals out of retention, the retention is set by deal_retain_count and deal_retain_secs of config
+     * @param max_rows - the max count of deals to prune
+     */
+    ACTION prunedeals(const uint32_t& max_rows);
+
+    /**
+     * move the orders of symbol pair from the legacy order table to the packed order table, by admin.
+     * the orders in legacy table are not matched, so pause the dex until all pairs are migrated
+     * @param max_rows - the max count of orders to move
+     */
+    ACTION migrateorder(const uint64_t& sympair_id, const uint32_t& max_rows);
+
+    /**
+     * move the queued orders of users from the legacy queue rows to the new queue rows, by admin.
+     * the legacy queued orders can not be funded or deleted until migrated, their ids are kept
+     * @param max_rows - the max count of queued orders to move
+     */
+    ACTION migratequeue(const uint32_t& max_rows);
+
+    /**
+     * move the rewards of users from the legacy rewards table to one row per (owner, token), by admin.
+     * the rewards in legacy table can not be withdrawn until migrated
+     * @param max_rows - the max count of legacy rows to move
+     */
+    ACTION migreward(const uint32_t& max_rows);
+
     /**
      * cancel order where order not finished
      * 
     */
     ACTION cancel(const uint64_t& pair_id, const name& side, const uint64_t &order_id);
 
+    /**
+     * cancel orders in batch, the refunds are netted per owner and token
+     * @param orders - the orders to cancel, all owners must authorize
+    */
+    ACTION cancelmany(const vector<dex::cancel_param_t>& orders);
+
+    /**
+     * cancel all orders of owner, at most DEX_BATCH_ORDERS_MAX orders in one call
+     * @param owner - the owner of orders
+     * @param pair_id - cancel the orders of this symbol pair only if set, otherwise all enabled pairs
+    */
+    ACTION cancelall(const name& owner, const optional<uint64_t>& pair_id);
+
+    /**
+     * change the price and remaining quantity of a resting order, the released frozen funds are refunded.
+     * the order keeps its priority if the price is unchanged and the quantity is not increased,
+     * otherwise it is placed again with a new order_id.
+     * the amendment requiring more frozen funds must be made by transfer with amend memo
+     * @param remaining_quant - the new unmatched asset quantity
+     * @param price - the new price
+    */
+    ACTION amend(const name& owner, const uint64_t& pair_id, const name& side, const uint64_t& order_id,
+                 const asset& remaining_quant, const asset& price);
+
 
     /**
      * delete queue order
+     * @param user - owner of queued order
+     * @param queue_order_id - the queued order id, delete all queued orders of user if 0
     */
-    ACTION delqueueord(const name& user);
+    ACTION delqueueord(const name& user, const uint64_t& queue_order_id);
 
     /**
      * internal action for order matched.
-     * deal items
-     * 
+     * @param deal_items - the packed deals of one match, see packed_deal_t
+     * @param memo - the memo of all deals, referred by memo_id of deals
+    */
+    ACTION adddexdeal(const std::vector<dex::packed_deal_t>& deal_items, const string& memo,
+                      const time_point_sec& curr_ts );
+
+    /**
+     * internal action for order placed, matched at once or amended
+     * @param order_event - the lean order info, see order_event_t
     */
-    ACTION adddexdeal(const std::list<dex::deal_item_t>& deal_items, const time_point_sec& curr_ts );
+    ACTION orderchange( const dex::order_event_t& order_event );
 
-    ACTION orderchange( const uint64_t order_id, const dex::order_t& order);
+    /**
+     * internal action for balance change, sent in notify mode of balance log
+    */
+    ACTION balancechg( const dex::balance_chg_t& change);
+
+    /**
+     * delete the cached referral chains, they will be reloaded on next use
+     * @param users - the users whose referral chain is changed
+     */
+    ACTION delreferral(const vector<name>& users);
 
     // using withdraw_action   = action_wrapper<"withdraw"_n, &dex_contract::withdraw>;
     using neworder_action   = action_wrapper<"neworder"_n,  &dex_contract::neworder>;
+    using neworders_action  = action_wrapper<"neworders"_n, &dex_contract::neworders>;
     using buy_action        = action_wrapper<"buy"_n,       &dex_contract::buy>;
     using sell_action       = action_wrapper<"sell"_n,      &dex_contract::sell>;
     using match_action      = action_wrapper<"match"_n,     &dex_contract::match>;
@@ -111,6 +212,7 @@ public:
 
     using deal_action       = action_wrapper<"adddexdeal"_n, &dex_contract::adddexdeal>;
     using orderchange_action= action_wrapper<"orderchange"_n, &dex_contract::orderchange>;
+    using balancechg_action = action_wrapper<"balancechg"_n, &dex_contract::balancechg>;
 
 
 public:
@@ -152,25 +254,99 @@ public:
 private:
     dex::config get_default_config();
 
-    void _allot_fee( const name &from_user, const name& bank, const asset& fee, const uint64_t order_id );
+    void _allot_fee( const name &from_user, const extended_symbol& fee_symbol, const asset& fee,
+                     dex::reward_changes_t &reward_changes );
+
+    const dex::referral_t& get_referral(const name &user);
 
     void match_sympair(const name &matcher, const dex::symbol_pair_t &sym_pair, uint32_t max_count,
-                        uint32_t &matched_count, const string &memo);
-    void update_latest_deal_price(const uint64_t& sympair_id, const asset& latest_deal_price);
+                        uint32_t &matched_count, const string &memo, dex::order_t *taker_order = nullptr);
+    void save_match_cursor(dex::match_cursor_tbl &cursor_tbl, const name &matcher, const uint64_t& sympair_id,
+                           uint32_t matched_count);
+    void amend_order(const name& owner, const uint64_t& pair_id, const name& side, const uint64_t& order_id,
+                     const asset& remaining_quant, const asset& price, const asset& paid_quant);
+    void check_fill_or_kill(const dex::order_t &order);
+    void unfreeze_order(const dex::symbol_pair_t &sym_pair, const dex::order_t &order, dex::settlements_t &refunds);
+    void refresh_best_price(const uint64_t& sympair_id, const name &side);
+    void refund_orders(const dex::settlements_t &refunds, const string &memo);
+    void update_sympair_prices(const uint64_t& sympair_id, const asset& best_bid_price,
+                               const asset& best_ask_price, const asset& latest_deal_price);
+    void update_depth(const dex::symbol_pair_t &sym_pair, const name &side, const int64_t &price,
+                      const dex::depth_delta_t &delta);
 
     void new_order(const name &user, const uint64_t &sympair_id,
             const name &order_side,
             const asset &total_asset_quant,
             const optional<asset> &price,
             const uint64_t &ext_id,
-            const optional<dex::order_config_ex_t> &order_config_ex);
+            const optional<dex::order_config_ex_t> &order_config_ex,
+            const name &time_in_force);
+
+    void check_queue_size(const dex::queue_tbl &queue_tbl, const name &user, uint32_t new_count);
+
+    void queue_order(dex::queue_tbl &queue_tbl, const name &user,
+            const dex::symbol_pair_t &sym_pair,
+            const name &order_side,
+            const asset &total_asset_quant,
+            const optional<asset> &price,
+            const uint64_t &ext_id,
+            const int64_t &taker_fee_ratio,
+            const int64_t &maker_fee_ratio,
+            const name &time_in_force);
+
+    dex::order_t make_order(const name &user,
+            const dex::symbol_pair_t &sym_pair,
+            const name &order_side,
+            const asset &total_asset_quant,
+            const optional<asset> &price,
+            const uint64_t &ext_id,
+            const int64_t &taker_fee_ratio,
+            const int64_t &maker_fee_ratio,
+            const name &time_in_force);
+
+    void check_frozen_quant(const dex::symbol_pair_t &sym_pair, const dex::order_t &order, const asset &quant);
+
+    void place_order(const dex::symbol_pair_t &sym_pair, dex::order_t &order);
+
+    void log_balance(const name &user, const name &bank, const asset &quantity, const name &type, const string& memo);
 
     void add_balance(const name &user, const name &bank, const asset &quantity, const name &type, const string& memo);
 
+    void add_rewards(const dex::reward_changes_t &changes);
+
+    void add_reward(dex::rewards_tbl &rewards, const name &user, const extended_symbol &ext_symbol, const int64_t &amount);
+
 
     bool check_dex_enabled();
 
+    // the config is loaded on first access, the default config is used if not set
+    inline const dex::config& get_config() {
+        if (!_config) {
+            _config = _conf_tbl.exists() ? _conf_tbl.get() : get_default_config();
+        }
+        return *_config;
+    }
+
+    // the global state is loaded on first access
+    inline dex::global_state& get_global() {
+        if (!_global) {
+            _global = dex::global_state::make_global(get_self());
+        }
+        return *_global;
+    }
+
+    // the ring head of balance log is loaded on first use, and saved once when the action ends
+    inline uint64_t new_balance_log_id() {
+        if (!_balance_log_head) {
+            _balance_log_head = dex::balance_log_head_table(get_self(), get_self().value).get_or_default();
+        }
+        return ++_balance_log_head->last_id;
+    }
+
     dex::config_table _conf_tbl;
-    dex::config _config;
+    std::optional<dex::config> _config;
     dex::global_state::ptr_t _global;
+    dex::pair_seqs_state _pair_seqs;               // id sequences of the pairs used by this action
+    std::optional<dex::balance_log_head> _balance_log_head;
+    std::map<name, dex::referral_t> _referrals;     // referral chains loaded by this action
 };
@@ -10,6 +10,10 @@ constexpr int64_t FEE_RATIO_MAX             = 4999;      // 49.99%, max fee rati
 constexpr int64_t DEX_MAKER_FEE_RATIO       = 4;         // 0.04%, dex maker fee ratio
 constexpr int64_t DEX_TAKER_FEE_RATIO       = 8;         // 0.04%, dex taker fee ratio
 constexpr uint32_t DEX_MATCH_COUNT_MAX      = 50;         // the max dex match count.
+constexpr uint32_t DEX_BATCH_ORDERS_MAX     = 50;         // the max order count of batch order placement
+constexpr uint32_t DEX_QUEUE_ORDERS_MAX     = 100;        // the max queued order count of one user
+constexpr uint32_t DEX_MATCH_PAIRS_MAX      = 100;        // the max pair count of one matchmany
+constexpr uint64_t DEX_PAIR_SEQ_BITS        = 40;         // the low bits of order and deal ids for the sequence in pair
 
 constexpr int64_t MEMO_LEN_MAX              = 255;        // 0.001%, max memo length
 constexpr int64_t URL_LEN_MAX               = 255;        // 0.001%, max url length
@@ -43,5 +47,5 @@ static constexpr symbol APL_SYMBOL      = SYMBOL("APL",4);
 
 
 #define CHECK_DEX_ENABLED() { \
-    CHECKC(_config.dex_enabled, err::STATUS_ERROR, string("DEX is disabled! function=") + __func__) \
+    CHECKC(get_config().dex_enabled, err::STATUS_ERROR, string("DEX is disabled! function=") + __func__) \
 }
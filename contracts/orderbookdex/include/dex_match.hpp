@@ -44,6 +44,13 @@ namespace dex {
         return asset(calc_coin_amount(asset_quant, price, coin_symbol), coin_symbol);
     }
 
+    // the max asset quantity which the coins can buy at price, rounded down
+    inline asset calc_affordable_asset_quant(const asset &coin_quant, const asset &price, const symbol &asset_symbol) {
+        ASSERT(coin_quant.symbol.precision() == price.symbol.precision());
+        int128_t amount = int128_t(coin_quant.amount) * calc_precision(asset_symbol.precision()) / price.amount;
+        return asset(int64_t(std::min<int128_t>(amount, asset::max_amount)), asset_symbol);
+    }
+
     inline asset calc_match_fee(int64_t ratio, const asset &quant) {
         if (quant.amount == 0) return asset{0, quant.symbol};
         int64_t fee = multiply_decimal64(quant.amount, ratio, RATIO_PRECISION);
@@ -56,57 +63,89 @@ namespace dex {
         return calc_match_fee(ratio, quant);
     }
 
-    template<typename table_t, typename index_t>
-    class table_index_iterator {
-    public:
-        using table_uptr = std::shared_ptr<table_t>;
-        using index_uptr = std::shared_ptr<index_t>;
-        using const_iterator = typename index_t::const_iterator;
+    struct depth_delta_t {
+        int64_t     quantity    = 0;
+        int32_t     order_count = 0;
+    };
 
-        table_index_iterator(table_uptr tbl, index_uptr idx, const_iterator itr) :
-            tbl(tbl), idx(idx), itr(itr) {}
+    // (order_side, price amount) -> the depth delta of price level
+    using depth_changes_t = std::map<std::pair<order_side_t, int64_t>, depth_delta_t>;
 
-        table_uptr tbl;
-        index_uptr idx;
-        const_iterator itr;
+    // (user, extended symbol) -> the amount to transfer to user after matching
+    using settlements_t = std::map<std::pair<name, extended_symbol>, int64_t>;
 
-        inline bool is_valid() const {
-            return itr != idx->end();
-        }
-    };
+    // (user, balance type, extended symbol) -> the reward amount to credit to user after matching
+    using reward_changes_t = std::map<std::tuple<name, name, extended_symbol>, int64_t>;
 
-    template<typename table_t, typename index_t>
+    /**
+     * the order iterator lives in the caller's stack with the order table and symbol pair, which must outlive it.
+     * the packed row of current order is unpacked to order_t once when the iterator moves to it.
+     * the table iterator refers to the index member, so the order iterator can not be copied or moved
+     */
+    template<typename index_t>
     class matching_order_iterator {
     public:
-        using table_index_iterator_ptr = std::shared_ptr<table_index_iterator<table_t, index_t>>;
-        matching_order_iterator(table_index_iterator_ptr idx_itr, uint64_t sympair_id, order_side_t side)
-            : _idx_itr(idx_itr), _sym_pair_id(sympair_id), _order_side(side)
+        using const_iterator = typename index_t::const_iterator;
+
+        matching_order_iterator(const index_t &idx, const symbol_pair_t &sym_pair, order_side_t side)
+            : _idx(idx), _itr(_idx.begin()), _sym_pair(sym_pair), _order_side(side)
+        {
+            process_data();
+        };
+
+        // iterate the taker order only, the other orders of its side are skipped
+        matching_order_iterator(const index_t &idx, const symbol_pair_t &sym_pair, const order_t &taker_order)
+            : _idx(idx), _itr(_idx.find(taker_order.by_price_order())), _sym_pair(sym_pair),
+              _order_side(taker_order.order_side), _taker_order_id(taker_order.order_id)
+        {
+            process_data();
+        };
+
+        // iterate the transient taker order which is not stored in order table, the matched result is saved to it
+        matching_order_iterator(const index_t &idx, const symbol_pair_t &sym_pair, order_t *transient_order)
+            : _idx(idx), _itr(_idx.end()), _sym_pair(sym_pair),
+              _order_side(transient_order->order_side), _transient_order(transient_order)
         {
             process_data();
         };
 
+        matching_order_iterator(const matching_order_iterator&) = delete;
+        matching_order_iterator(matching_order_iterator&&) = delete;
+        matching_order_iterator& operator=(const matching_order_iterator&) = delete;
+        matching_order_iterator& operator=(matching_order_iterator&&) = delete;
+
         void complete_and_next() {
             TRACE_L("matching_order_iterator::complete_and_next");
-            ASSERT(_idx_itr->is_valid());
-            _idx_itr->itr = _idx_itr->idx->erase(_idx_itr->itr);
+            ASSERT(is_valid());
+            if (_transient_order) {
+                _transient_done = true;
+            } else {
+                _itr = _idx.erase(_itr);
+            }
             process_data();
         }
 
         void save_matching_order() {        //TODO check matching status
             TRACE_L("matching_order_iterator::save_matching_order");
-            if(_idx_itr && _idx_itr->is_valid() ) {
-                _idx_itr->idx->modify(_idx_itr->itr, same_payer, [&]( auto& a ) {
-                    a.matched_asset_quant = _matched_asset_quant;
-                    a.matched_coin_quant = _matched_coin_quant;
-                    a.matched_fee = _matched_fee;
+            if (_transient_order) {
+                _transient_order->matched_asset_quant = _matched_asset_quant;
+                _transient_order->matched_coin_quant = _matched_coin_quant;
+                _transient_order->matched_fee = _matched_fee;
+                _transient_order->last_updated_at = current_block_time();
+                _transient_order->last_deal_id = _last_deal_id;
+            } else if( is_valid() ) {
+                _idx.modify(_itr, same_payer, [&]( auto& a ) {
+                    a.matched_asset_amount = _matched_asset_quant.amount;
+                    a.matched_coin_amount = _matched_coin_quant.amount;
+                    a.matched_fee = _matched_fee.amount;
                     a.last_updated_at = current_block_time();
                     a.last_deal_id = _last_deal_id;
                 });
             }
         }
 
-        inline const order_t &stored_order() {
-            return *_idx_itr->itr;
+        inline const order_t &stored_order() const {
+            return _transient_order ? *_transient_order : _order;
         }
 
         inline void match(uint64_t deal_id,
@@ -118,7 +157,7 @@ namespace dex {
             _matched_asset_quant += new_matched_asset_quant;
             _matched_coin_quant  += new_matched_coin_quant;
             _matched_fee    += new_matched_fee;
-            const auto &order = *_idx_itr->itr;
+            const auto &order = stored_order();
 
             CHECK(_matched_asset_quant <= order.total_asset_quant,
                 "The matched assets=" + _matched_asset_quant.to_string() +
@@ -138,16 +177,26 @@ namespace dex {
 
         inline asset get_free_total_asset_quant() const {
             TRACE_L("get_free_total_asset_quant");
-            ASSERT(_idx_itr->is_valid());
-            asset ret = _idx_itr->itr->total_asset_quant - _matched_asset_quant;
+            ASSERT(is_valid());
+            asset ret = stored_order().total_asset_quant - _matched_asset_quant;
             ASSERT(ret.amount >= 0);
             return ret;
         }
 
+        // the unmatched frozen coins of buy order
+        inline asset get_free_coins() const {
+            ASSERT(is_valid());
+            return stored_order().total_frozen_quant - _matched_coin_quant;
+        }
+
+        inline bool is_market() const {
+            return stored_order().order_type == order_type::MARKET;
+        }
+
         inline asset get_refund_coins() const {
             TRACE_L("get_refund_coins");
 
-            ASSERT(_idx_itr->is_valid());
+            ASSERT(is_valid());
             return _refund_coins;
         }
 
@@ -156,8 +205,18 @@ namespace dex {
         }
 
         inline bool is_valid() const {
-            TRACE_L("is_valid():  _idx_itr && _idx_itr->is_valid() ");
-            return _idx_itr && _idx_itr->is_valid();
+            if (_transient_order) return !_transient_done;
+            return _itr != _idx.end() && (_taker_order_id == 0 || _itr->order_id == _taker_order_id);
+        }
+
+        inline bool is_transient() const {
+            return _transient_order != nullptr;
+        }
+
+        // the top price of this side in order book, 0 if no order
+        inline asset best_price(const symbol &coin_symbol) const {
+            auto itr = (_taker_order_id == 0 && !_transient_order) ? _itr : _idx.begin();
+            return asset(itr != _idx.end() ? itr->price : 0, coin_symbol);
         }
 
         inline bool is_completed() const {
@@ -168,12 +227,15 @@ namespace dex {
         void process_data() {
             TRACE_L("process_data");
 
-            if (!_idx_itr->is_valid()) {
-                TRACE("matching order itr end! sympair_id=", _sym_pair_id, ", side=", _order_side, "\n");
+            if (!is_valid()) {
+                TRACE("matching order itr end! sympair_id=", _sym_pair.sympair_id, ", side=", _order_side, "\n");
                 return;
             }
+            if (!_transient_order) {
+                _order = _itr->unpack(_sym_pair);
+            }
 
-            const auto &stored_order = *_idx_itr->itr;
+            const auto &stored_order = this->stored_order();
             TRACE("found order! order=", stored_order, "\n");
 
             _last_deal_id   = stored_order.last_deal_id;
@@ -184,9 +246,14 @@ namespace dex {
             _complete       = false;
         }
 
-        table_index_iterator_ptr    _idx_itr;
-        uint64_t                    _sym_pair_id;
+        index_t                     _idx;
+        const_iterator              _itr;
+        const symbol_pair_t         &_sym_pair;
         order_side_t                _order_side;
+        order_t                     _order;                 // the unpacked current order of order table
+        uint64_t                    _taker_order_id = 0;    // 0 means all orders of this side
+        order_t                     *_transient_order = nullptr;
+        bool                        _transient_done = false;
 
         uint64_t                    _last_deal_id = 0;
         asset                       _matched_asset_quant;      //!< total matched asset amount
@@ -196,12 +263,13 @@ namespace dex {
         bool                        _complete;
     };
 
+    /**
+     * the pair iterator refers to the buy and sell order iterators, which must outlive it
+     */
     template<typename order_iterator_t>
     class matching_pair_iterator {
     public:
-        using order_iterator_ptr = std::shared_ptr<order_iterator_t>;
-
-        matching_pair_iterator(const dex::symbol_pair_t& sym_pair, order_iterator_ptr buy_itr, order_iterator_ptr sell_itr )
+        matching_pair_iterator(const dex::symbol_pair_t& sym_pair, order_iterator_t &buy_itr, order_iterator_t &sell_itr )
             : _sym_pair(sym_pair), _buy_itr(buy_itr), _sell_itr(sell_itr)  {
             process_data();
         }
@@ -224,8 +292,8 @@ namespace dex {
         }
 
         void save_matching_order() {
-            _buy_itr->save_matching_order( );
-            _sell_itr->save_matching_order( );
+            _buy_itr.save_matching_order( );
+            _sell_itr.save_matching_order( );
         }
 
         bool can_match() const  {
@@ -255,6 +323,11 @@ namespace dex {
             asset taker_free_assets;
 
             taker_free_assets = _taker_itr->get_free_total_asset_quant();
+            if (_taker_itr->is_market() && _taker_itr->order_side() == order_side::BUY) {
+                // the market buy order is limited by its coin budget
+                auto affordable_assets = calc_affordable_asset_quant(_taker_itr->get_free_coins(), matched_price, asset_symbol);
+                if (affordable_assets < taker_free_assets) taker_free_assets = affordable_assets;
+            }
             ASSERT(taker_free_assets.symbol == asset_symbol);
             CHECK(taker_free_assets.amount > 0, "MUST: taker_free_assets > 0");
 
@@ -265,10 +338,10 @@ namespace dex {
     private:
         const dex::symbol_pair_t &_sym_pair;
 
-        order_iterator_ptr _buy_itr;
-        order_iterator_ptr _sell_itr;
-        order_iterator_ptr _taker_itr = nullptr;
-        order_iterator_ptr _maker_itr = nullptr;
+        order_iterator_t &_buy_itr;
+        order_iterator_t &_sell_itr;
+        order_iterator_t *_taker_itr = nullptr;
+        order_iterator_t *_maker_itr = nullptr;
         bool _can_match = false;
 
         void process_data() {
@@ -279,19 +352,26 @@ namespace dex {
             if (!_can_match) {
                 TRACE_L("_can_match begin");
                 _can_match = true;
-                TRACE_L("_can_match: ", _buy_itr->is_valid(), _sell_itr->is_valid(),", buy:", _buy_itr->stored_order().order_id, "  ",
-                                         _buy_itr->stored_order().price,", sell:", _buy_itr->stored_order().order_id, "  ", _sell_itr->stored_order().price);
-                if ( _buy_itr->is_valid() && _sell_itr->is_valid() &&
-                     _buy_itr->stored_order().price >= _sell_itr->stored_order().price ) {
-                    if ( _buy_itr->stored_order().order_id > _sell_itr->stored_order().order_id ) {
-                        _taker_itr = _buy_itr;
-                        _maker_itr = _sell_itr;
+                TRACE_L("_can_match: ", _buy_itr.is_valid(), _sell_itr.is_valid(),", buy:", _buy_itr.stored_order().order_id, "  ",
+                                         _buy_itr.stored_order().price,", sell:", _buy_itr.stored_order().order_id, "  ", _sell_itr.stored_order().price);
+                // the market order has no price, it matches any price of opposite side
+                if ( _buy_itr.is_valid() && _sell_itr.is_valid() &&
+                     ( _buy_itr.is_market() || _sell_itr.is_market() ||
+                       _buy_itr.stored_order().price >= _sell_itr.stored_order().price ) ) {
+                    if ( _buy_itr.stored_order().order_id > _sell_itr.stored_order().order_id ) {
+                        _taker_itr = &_buy_itr;
+                        _maker_itr = &_sell_itr;
                     } else {
-                        _taker_itr = _sell_itr;
-                        _maker_itr = _buy_itr;
+                        _taker_itr = &_sell_itr;
+                        _maker_itr = &_buy_itr;
                     }
 
-                    TRACE_L("_can_match end, true");
+                    if (_taker_itr->is_market() && _taker_itr->order_side() == order_side::BUY) {
+                        // stop when the left budget can not buy any asset at the maker price
+                        _can_match = calc_affordable_asset_quant(_taker_itr->get_free_coins(), _maker_itr->stored_order().price,
+                                                                 _sym_pair.asset_symbol.get_symbol()).amount > 0;
+                    }
+                    TRACE_L("_can_match end, ", _can_match);
                 } else {
                     _can_match = false;
                     TRACE_L("_can_match end, false");
@@ -304,23 +384,21 @@ namespace dex {
         }
     };
 
-    template<typename table_t, typename index_t>
-    inline auto make_table_index_iterator(std::shared_ptr<table_t> tbl, 
-                                            std::shared_ptr<index_t> idx, 
-                                            typename index_t::const_iterator itr) {
-        return std::make_shared<table_index_iterator<table_t, index_t>>(tbl, idx, itr);
-    }
-
-    inline auto make_order_iterator(const name contract,
+    inline auto make_order_iterator(order_tbl &tbl,
                                     const dex::symbol_pair_t &sym_pair, 
                                     const order_side_t &side) {
+        auto idx = tbl.get_index<"priceorder"_n>();
+        return matching_order_iterator<decltype(idx)>(idx, sym_pair, side);
+    }
 
-        auto tbl = std::make_shared<order_tbl>(make_order_table( contract, sym_pair.sympair_id, side ));
+    inline auto make_taker_order_iterator(order_tbl &tbl, const dex::symbol_pair_t &sym_pair, const order_t &taker_order) {
+        auto idx = tbl.get_index<"priceorder"_n>();
+        return matching_order_iterator<decltype(idx)>(idx, sym_pair, taker_order);
+    }
 
-        auto idx_obj = tbl->get_index<"orderprice"_n>();
-        auto idx  = std::make_shared<decltype(idx_obj)>(idx_obj);
-        auto itr = make_table_index_iterator(tbl, idx, idx->begin());
-        return std::make_shared<matching_order_iterator<order_tbl, decltype(idx_obj)>>(itr, sym_pair.sympair_id, side);
+    inline auto make_transient_order_iterator(order_tbl &tbl, const dex::symbol_pair_t &sym_pair, order_t *transient_order) {
+        auto idx = tbl.get_index<"priceorder"_n>();
+        return matching_order_iterator<decltype(idx)>(idx, sym_pair, transient_order);
     }
 
 }// namespace dex
\ No newline at end of file
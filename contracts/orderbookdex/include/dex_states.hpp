@@ -6,6 +6,7 @@
 #include <eosio/name.hpp>
 #include <eosio/asset.hpp>
 #include <eosio/singleton.hpp>
+#include <eosio/binary_extension.hpp>
 #include "dex_const.hpp"
 #include "dex_states.hpp"
 #include "utils.hpp"
@@ -52,6 +53,53 @@ namespace dex {
         static constexpr name grandreward   = "grandreward"_n;
     }
 
+    namespace balance_log_mode {
+        static constexpr name FULL      = "full"_n;     // keep all balance changes in balances table
+        static constexpr name NOTIFY    = "notify"_n;   // only notify balance changes by inline action
+        static constexpr name RING      = "ring"_n;     // keep the latest balance_log_size changes in balances table
+
+        inline bool is_valid(const name &value) {
+            return value == FULL || value == NOTIFY || value == RING;
+        }
+    }
+
+    // time in force of order
+    namespace order_tif {
+        static constexpr name GTC       = "gtc"_n;      // good till canceled, the unmatched part rests in order book
+        static constexpr name IOC       = "ioc"_n;      // immediate or cancel, the unmatched part is refunded at once
+        static constexpr name FOK       = "fok"_n;      // fill or kill, fail if it can not be fully matched at once
+        static constexpr name POSTONLY  = "postonly"_n; // fail if it would match at once, otherwise rest as GTC
+
+        inline bool is_valid(const name &value) {
+            return value == GTC || value == IOC || value == FOK || value == POSTONLY;
+        }
+
+        // the immediate order is matched as taker and never rests in order book
+        inline bool is_immediate(const name &value) {
+            return value == IOC || value == FOK;
+        }
+
+        // name -> index
+        static const std::map<name, uint8_t> ENUM_MAP = {
+            {GTC,       1},
+            {IOC,       2},
+            {FOK,       3},
+            {POSTONLY,  4}
+        };
+        inline uint8_t index(const name &value) {
+            if (value.value == 0) return 0;
+            auto it = ENUM_MAP.find(value);
+            CHECKC(it != ENUM_MAP.end(), err::PARAM_ERROR, "Invalid time_in_force=" + value.to_string());
+            return it->second;
+        }
+        inline name from_index(uint8_t index) {
+            for (const auto &item : ENUM_MAP) {
+                if (item.second == index) return item.first;
+            }
+            return name();
+        }
+    }
+
     namespace order_type {
         static const order_type_t NONE = order_type_t();
         static const order_type_t LIMIT = "limit"_n;
@@ -72,6 +120,13 @@ namespace dex {
                 CHECK(it != ENUM_MAP.end(), "Invalid order_type=" + value.to_string());
                 return it->second;
         }
+
+        inline order_type_t from_index(uint8_t index) {
+            for (const auto &item : ENUM_MAP) {
+                if (item.second == index) return item.first;
+            }
+            return NONE;
+        }
     }
 
     namespace order_side {
@@ -93,6 +148,12 @@ namespace dex {
             CHECKC(it != ENUM_MAP.end(), err::PARAM_ERROR, "Invalid order_side=" + value.to_string());
             return it->second;
         }
+        inline order_side_t from_index(uint8_t index) {
+            for (const auto &item : ENUM_MAP) {
+                if (item.second == index) return item.first;
+            }
+            return NONE;
+        }
     }
 
     struct order_config_ex_t {
@@ -100,6 +161,22 @@ namespace dex {
         uint64_t maker_fee_ratio = 0;
     };
 
+    // order params of batch order placement
+    struct order_param_t {
+        uint64_t        sympair_id;
+        order_side_t    order_side;
+        asset           total_asset_quant;
+        asset           price;
+        uint64_t        ext_id;
+        name            time_in_force;      // see order_tif, GTC if empty
+    };
+
+    struct cancel_param_t {
+        uint64_t        sympair_id;
+        order_side_t    order_side;
+        uint64_t        order_id;
+    };
+
     struct DEX_TABLE config {
         bool        dex_enabled;           // if false, disable all operation of common user
         name        dex_admin;             // admin of this contract, permisions: manage sym_pairs, authorize order
@@ -115,19 +192,33 @@ namespace dex {
 
         uint64_t    apl_farm_id;
         map<symbol_code, uint32_t> farm_scales;
+
+        // the fields below are appended to the deployed config row, so they are binary extensions
+        binary_extension<name>      balance_log_mode;   // the log mode of balance changes, see balance_log_mode, empty as full
+        binary_extension<uint32_t>  balance_log_size;   // the max rows of balances table in ring mode
+        binary_extension<uint32_t>  deal_retain_count;  // keep the latest count of deals per symbol pair, if 0 no limit
+        binary_extension<uint32_t>  deal_retain_secs;   // keep the deals in the latest seconds, if 0 no limit
+        binary_extension<bool>      entry_taker_only;   // if true, the new order only matches the opposite side as taker
     };
 
     typedef eosio::singleton< "config"_n, config > config_table;
 
     struct DEX_TABLE global {
-        uint64_t        order_id            = 0;        // the auto-increament id of order
-        uint64_t        queue_order_id      = 0;        // the auto-increament id of order
+        uint64_t        order_id            = 0;        // the last legacy order id, the new ids are made by pair_seq_t
+        uint64_t        queue_order_id      = 0;        // the auto-increament id of queued order, ascending in queue order
         uint64_t        sympair_id          = 0;         // the auto-increament id of symbol pair
-        uint64_t        deal_item_id        = 0;       // the auto-increament id of deal item
+        uint64_t        deal_item_id        = 0;       // the last legacy deal id, the new ids are made by pair_seq_t
     };
 
     typedef eosio::singleton< "global"_n, global > global_table;
 
+    // the head of balance log in ring mode, out of global, so that logging the fills does not write global
+    struct DEX_TABLE balance_log_head {
+        uint64_t        last_id             = 0;        // the sequence of the last balance change log
+    };
+
+    typedef eosio::singleton< "balloghead"_n, balance_log_head > balance_log_head_table;
+
     struct global_state: public global {
     public:
         bool changed = false;
@@ -155,10 +246,6 @@ namespace dex {
             return id;
         }
 
-        inline uint64_t new_order_id() {
-            return new_auto_inc_id(order_id);
-        }
-
         inline uint64_t new_queue_order_id() {
             return new_auto_inc_id(queue_order_id);
         }
@@ -167,10 +254,6 @@ namespace dex {
             return new_auto_inc_id(sympair_id);
         }
 
-        inline uint64_t new_deal_item_id() {
-            return new_auto_inc_id(deal_item_id);
-        }
-
         inline void change() {
             changed = true;
         }
@@ -186,6 +269,96 @@ namespace dex {
         std::unique_ptr<global_table> _global_tbl;
     };
 
+    /**
+     * the ids of orders and deals are made from (sympair_id, seq),
+     * so they are unique in all pairs and ascending in one pair.
+     * the legacy ids made by global are less than the ids of any pair
+     */
+    static constexpr uint64_t PAIR_SEQ_MAX = (uint64_t(1) << DEX_PAIR_SEQ_BITS) - 1;
+
+    inline static uint64_t make_pair_seq_id(const uint64_t &sympair_id, const uint64_t &seq) {
+        return sympair_id << DEX_PAIR_SEQ_BITS | seq;
+    }
+
+    inline static uint64_t get_pair_id(const uint64_t &id) { return id >> DEX_PAIR_SEQ_BITS; }
+    inline static uint64_t get_pair_seq(const uint64_t &id) { return id & PAIR_SEQ_MAX; }
+
+    // the id sequences of symbol pair, scope: self
+    struct DEX_TABLE pair_seq_t {
+        uint64_t        sympair_id;
+        uint64_t        order_seq           = 0;
+        uint64_t        deal_seq            = 0;
+
+        uint64_t primary_key() const { return sympair_id; }
+
+        EOSLIB_SERIALIZE(pair_seq_t, (sympair_id)(order_seq)(deal_seq))
+    };
+
+    typedef eosio::multi_index<"pairseq"_n, pair_seq_t> pair_seq_tbl;
+
+    /**
+     * the pair sequences loaded by this action, every changed row is saved once when the action ends
+     */
+    struct pair_seqs_state {
+    public:
+        explicit pair_seqs_state(const name &contract): _pair_seq_tbl(contract, contract.value) {}
+
+        inline uint64_t new_order_id(const uint64_t &sympair_id) {
+            return new_pair_seq_id(sympair_id, &pair_seq_t::order_seq);
+        }
+
+        inline uint64_t new_deal_id(const uint64_t &sympair_id) {
+            return new_pair_seq_id(sympair_id, &pair_seq_t::deal_seq);
+        }
+
+        // the last deal id of pair, 0 if none
+        inline uint64_t last_deal_id(const uint64_t &sympair_id) {
+            auto deal_seq = get(sympair_id).deal_seq;
+            return deal_seq > 0 ? make_pair_seq_id(sympair_id, deal_seq) : 0;
+        }
+
+        inline void save(const name &payer) {
+            for (const auto &sympair_id : _changed) {
+                const auto &seq = _pair_seqs.at(sympair_id);
+                auto it = _pair_seq_tbl.find(sympair_id);
+                if (it == _pair_seq_tbl.end()) {
+                    _pair_seq_tbl.emplace(payer, [&](auto &row) { row = seq; });
+                } else {
+                    _pair_seq_tbl.modify(it, same_payer, [&](auto &row) { row = seq; });
+                }
+            }
+            _changed.clear();
+        }
+    private:
+        pair_seq_t& get(const uint64_t &sympair_id) {
+            auto it = _pair_seqs.find(sympair_id);
+            if (it != _pair_seqs.end()) return it->second;
+
+            auto seq_it = _pair_seq_tbl.find(sympair_id);
+            pair_seq_t seq;
+            if (seq_it != _pair_seq_tbl.end()) {
+                seq = *seq_it;
+            } else {
+                seq.sympair_id = sympair_id;
+            }
+            return _pair_seqs[sympair_id] = seq;
+        }
+
+        uint64_t new_pair_seq_id(const uint64_t &sympair_id, uint64_t pair_seq_t::*field) {
+            CHECKC( get_pair_id(make_pair_seq_id(sympair_id, 0)) == sympair_id, err::OVERSIZED,
+                "The sympair_id is too big for pair sequence id: " + std::to_string(sympair_id) )
+            auto &seq = get(sympair_id).*field;
+            CHECKC( seq < PAIR_SEQ_MAX,     err::OVERSIZED, "The pair sequence is used up: " + std::to_string(sympair_id) )
+            seq++;
+            _changed.insert(sympair_id);
+            return make_pair_seq_id(sympair_id, seq);
+        }
+
+        pair_seq_tbl _pair_seq_tbl;
+        std::map<uint64_t, pair_seq_t> _pair_seqs;
+        std::set<uint64_t> _changed;
+    };
+
     using uint256_t = fixed_bytes<32>;
 
     static inline uint256_t make_symbols_idx(const extended_symbol &asset_symbol, const extended_symbol &coin_symbol) {
@@ -196,6 +369,10 @@ namespace dex {
                 coin_symbol.get_symbol().code().raw());
     }
 
+    inline static bool is_price_crossed(const asset &best_bid_price, const asset &best_ask_price) {
+        return best_bid_price.amount > 0 && best_ask_price.amount > 0 && best_bid_price.amount >= best_ask_price.amount;
+    }
+
     struct DEX_TABLE symbol_pair_t {
         uint64_t        sympair_id; // PK: auto-increment
         extended_symbol asset_symbol;
@@ -210,9 +387,20 @@ namespace dex {
         int64_t         farm_ratio;
         int64_t         parent_fee_ratio;
         int64_t         grand_fee_ratio;
+        // the best prices are appended to the deployed sympair rows, so they are binary extensions.
+        // the rows without them are read as empty book, migrateorder refreshes them of the migrated pair
+        binary_extension<asset> best_bid_price;     // the highest buy price in order book, 0 if no buy order
+        binary_extension<asset> best_ask_price;     // the lowest sell price in order book, 0 if no sell order
 
         uint64_t primary_key() const { return sympair_id; }
         inline uint256_t get_symbols_idx() const { return make_symbols_idx(asset_symbol, coin_symbol); }
+        inline asset get_best_bid_price() const {
+            return best_bid_price.has_value() ? best_bid_price.value() : asset(0, coin_symbol.get_symbol());
+        }
+        inline asset get_best_ask_price() const {
+            return best_ask_price.has_value() ? best_ask_price.value() : asset(0, coin_symbol.get_symbol());
+        }
+        inline bool is_crossed() const { return is_price_crossed(get_best_bid_price(), get_best_ask_price()); }
 
     };
 
@@ -223,15 +411,18 @@ namespace dex {
         return symbol_pair_table(self, self.value/*scope*/);
     }
 
-    using order_price_idx_key = uint64_t;
-    inline static order_price_idx_key make_order_price_idx( const order_side_t& side ) {
-        uint64_t price_factor = (side == order_side::BUY) ? std::numeric_limits<uint64_t>::max()  : 0;
-        return price_factor;
-    }
-
     uint128_t make_uint128(uint64_t high_val, uint64_t low_val) {
         return uint128_t(high_val) << 64 | uint128_t(low_val);
     }
+
+    /**
+     * price-time key of order table: the best price goes first, then the earliest order_id
+     * buy prices are inverted so that both sides are in ascending order
+     */
+    inline static uint128_t make_price_order_key(const order_side_t& side, int64_t price_amount, uint64_t order_id) {
+        uint64_t price_key = side == order_side::BUY ? (std::numeric_limits<uint64_t>::max() - price_amount) : price_amount;
+        return make_uint128(price_key, order_id);
+    }
     //scope: order_side +  sympair_id
     struct DEX_TABLE order_t {
         uint64_t        order_id;           
@@ -251,17 +442,13 @@ namespace dex {
         time_point      created_at;
         time_point      last_updated_at;
         uint64_t        last_deal_id;
+        name            time_in_force;      // see order_tif, the legacy queued rows without it are moved by migratequeue
 
         uint64_t primary_key() const    { return order_id; }
         uint64_t by_owner()const        { return owner.value; }
+        uint128_t by_owner_order()const { return make_uint128(owner.value, order_id); }
         uint64_t by_ext_id()const       { return ext_id; }
-        uint64_t get_price()const       { 
-            return order_side == order_side::BUY ? (std::numeric_limits<uint64_t>::max() - price.amount): price.amount;
-        }
-
-        order_price_idx_key get_order_price_idx()const { 
-            return make_order_price_idx( order_side ); 
-        }
+        uint128_t by_price_order()const { return make_price_order_key(order_side, price.amount, order_id); }
 
         void print() const {
             auto created_at = this->created_at.elapsed.count(); // print the ms value
@@ -283,22 +470,234 @@ namespace dex {
                 PP(matched_fee),
                 PP(created_at),
                 PP(last_updated_at),
-                PP(last_deal_id)
+                PP(last_deal_id),
+                PP(time_in_force)
             );
         }
     };
 
-    using order_price_idx = indexed_by<"orderprice"_n, const_mem_fun<order_t, uint64_t, &order_t::get_price> >;
-    using order_owner_idx = indexed_by<"orderowner"_n, const_mem_fun<order_t, uint64_t, &order_t::by_owner> >;
+    using queue_owner_idx = indexed_by<"ownerorder"_n, const_mem_fun<order_t, uint128_t, &order_t::by_owner_order> >;
 
-    typedef eosio::multi_index<"order"_n, order_t, order_price_idx> order_tbl;
-    typedef eosio::multi_index<"queue"_n, order_t, order_owner_idx> queue_tbl;
+    typedef eosio::multi_index<"queue"_n, order_t, queue_owner_idx> queue_tbl;
+
+    /**
+     * the frozen row of the deployed "order" and "queue" tables, only read by the migrateorder and migratequeue actions.
+     * do not change it, the deployed rows and their orderprice and orderowner indexes must be read as they are
+     */
+    struct DEX_TABLE legacy_order_t {
+        uint64_t        order_id;
+        uint64_t        ext_id;             // external id
+        name            owner;
+        uint64_t        sympair_id;         // id of symbol_pair_table
+        order_side_t    order_side;         // buy | sell
+        order_type_t    order_type;         // limit price | market price
+        asset           price;
+        asset           total_asset_quant;
+        asset           total_frozen_quant;
+        int64_t         taker_fee_ratio;
+        int64_t         maker_fee_ratio;
+        asset           matched_asset_quant; //!< total matched asset quantity
+        asset           matched_coin_quant;  //!< total matched coin quantity
+        asset           matched_fee;        //!< total matched fees
+        time_point      created_at;
+        time_point      last_updated_at;
+        uint64_t        last_deal_id;
+
+        uint64_t primary_key() const    { return order_id; }
+        uint64_t by_owner()const        { return owner.value; }
+        uint64_t get_price()const       {
+            return order_side == order_side::BUY ? (std::numeric_limits<uint64_t>::max() - price.amount): price.amount;
+        }
+
+        // the legacy order rests in order book, so it is good till canceled
+        order_t to_order() const {
+            order_t order;
+            order.order_id              = order_id;
+            order.ext_id                = ext_id;
+            order.owner                 = owner;
+            order.sympair_id            = sympair_id;
+            order.order_side            = order_side;
+            order.order_type            = order_type;
+            order.price                 = price;
+            order.total_asset_quant     = total_asset_quant;
+            order.total_frozen_quant    = total_frozen_quant;
+            order.taker_fee_ratio       = taker_fee_ratio;
+            order.maker_fee_ratio       = maker_fee_ratio;
+            order.matched_asset_quant   = matched_asset_quant;
+            order.matched_coin_quant    = matched_coin_quant;
+            order.matched_fee           = matched_fee;
+            order.created_at            = created_at;
+            order.last_updated_at       = last_updated_at;
+            order.last_deal_id          = last_deal_id;
+            order.time_in_force         = order_tif::GTC;
+            return order;
+        }
+    };
+
+    using legacy_order_price_idx = indexed_by<"orderprice"_n, const_mem_fun<legacy_order_t, uint64_t, &legacy_order_t::get_price> >;
+
+    typedef eosio::multi_index<"order"_n, legacy_order_t, legacy_order_price_idx> legacy_order_tbl;
+
+    inline static legacy_order_tbl make_legacy_order_table(const name &self, const uint64_t& pair_id, const order_side_t& side ) {
+        return legacy_order_tbl(self, pair_id * 10000 + uint64_t(order_side::index(side)));
+    }
+
+    // the legacy queued rows are only reachable by their orderowner index, the new rows are not in it
+    using legacy_queue_owner_idx = indexed_by<"orderowner"_n, const_mem_fun<legacy_order_t, uint64_t, &legacy_order_t::by_owner> >;
+
+    typedef eosio::multi_index<"queue"_n, legacy_order_t, legacy_queue_owner_idx> legacy_queue_tbl;
+
+    inline static legacy_queue_tbl make_legacy_queue_table(const name &self) { return legacy_queue_tbl(self, self.value/*scope*/); }
+
+    /**
+     * the packed row of order book, about half the size of order_t.
+     * the symbols of amounts are derived from symbol pair, and the enums are saved as index
+     * scope: order_side + sympair_id, the same as legacy order table
+     */
+    struct DEX_TABLE packed_order_t {
+        uint64_t        order_id;
+        uint64_t        ext_id;             // external id
+        name            owner;
+        uint8_t         order_side;         // index of order_side
+        uint8_t         order_type;         // index of order_type
+        uint8_t         time_in_force;      // index of order_tif
+        uint16_t        taker_fee_ratio;
+        uint16_t        maker_fee_ratio;
+        int64_t         price;              //!< amount of coin symbol
+        int64_t         total_asset_amount;
+        int64_t         total_frozen_amount;  //!< coin amount for buy order, asset amount for sell order
+        int64_t         matched_asset_amount;
+        int64_t         matched_coin_amount;
+        int64_t         matched_fee;        //!< asset amount for buy order, coin amount for sell order
+        time_point      created_at;
+        time_point      last_updated_at;
+        uint64_t        last_deal_id;
+
+        uint64_t primary_key() const    { return order_id; }
+        uint64_t by_owner()const        { return owner.value; }
+        uint128_t by_price_order()const { return make_price_order_key(order_side::from_index(order_side), price, order_id); }
+
+        static packed_order_t pack(const order_t &order) {
+            packed_order_t row;
+            row.order_id                = order.order_id;
+            row.ext_id                  = order.ext_id;
+            row.owner                   = order.owner;
+            row.order_side              = order_side::index(order.order_side);
+            row.order_type              = order_type::index(order.order_type);
+            row.time_in_force           = order_tif::index(order.time_in_force);
+            row.taker_fee_ratio         = uint16_t(order.taker_fee_ratio);
+            row.maker_fee_ratio         = uint16_t(order.maker_fee_ratio);
+            row.price                   = order.price.amount;
+            row.total_asset_amount      = order.total_asset_quant.amount;
+            row.total_frozen_amount     = order.total_frozen_quant.amount;
+            row.matched_asset_amount    = order.matched_asset_quant.amount;
+            row.matched_coin_amount     = order.matched_coin_quant.amount;
+            row.matched_fee             = order.matched_fee.amount;
+            row.created_at              = order.created_at;
+            row.last_updated_at         = order.last_updated_at;
+            row.last_deal_id            = order.last_deal_id;
+            return row;
+        }
+
+        order_t unpack(const symbol_pair_t &sym_pair) const {
+            const auto &asset_symbol    = sym_pair.asset_symbol.get_symbol();
+            const auto &coin_symbol     = sym_pair.coin_symbol.get_symbol();
+            auto side = order_side::from_index(order_side);
+            const auto &frozen_symbol   = (side == order_side::BUY) ? coin_symbol : asset_symbol;
+            const auto &fee_symbol      = (side == order_side::BUY) ? asset_symbol : coin_symbol;
+
+            order_t order;
+            order.order_id              = order_id;
+            order.ext_id                = ext_id;
+            order.owner                 = owner;
+            order.sympair_id            = sym_pair.sympair_id;
+            order.order_side            = side;
+            order.order_type            = order_type::from_index(order_type);
+            order.price                 = asset(price, coin_symbol);
+            order.total_asset_quant     = asset(total_asset_amount, asset_symbol);
+            order.total_frozen_quant    = asset(total_frozen_amount, frozen_symbol);
+            order.taker_fee_ratio       = taker_fee_ratio;
+            order.maker_fee_ratio       = maker_fee_ratio;
+            order.matched_asset_quant   = asset(matched_asset_amount, asset_symbol);
+            order.matched_coin_quant    = asset(matched_coin_amount, coin_symbol);
+            order.matched_fee           = asset(matched_fee, fee_symbol);
+            order.created_at            = created_at;
+            order.last_updated_at       = last_updated_at;
+            order.last_deal_id          = last_deal_id;
+            order.time_in_force         = order_tif::from_index(time_in_force);
+            return order;
+        }
+
+        EOSLIB_SERIALIZE(packed_order_t, (order_id)(ext_id)(owner)(order_side)(order_type)(time_in_force)
+                                         (taker_fee_ratio)(maker_fee_ratio)(price)(total_asset_amount)
+                                         (total_frozen_amount)(matched_asset_amount)(matched_coin_amount)
+                                         (matched_fee)(created_at)(last_updated_at)(last_deal_id))
+    };
+
+    using packed_order_price_idx = indexed_by<"priceorder"_n, const_mem_fun<packed_order_t, uint128_t, &packed_order_t::by_price_order> >;
+    using packed_order_owner_idx = indexed_by<"orderowner"_n, const_mem_fun<packed_order_t, uint64_t, &packed_order_t::by_owner> >;
+
+    typedef eosio::multi_index<"orders"_n, packed_order_t, packed_order_price_idx, packed_order_owner_idx> order_tbl;
+
+    inline static order_tbl make_order_table(const name &self, const uint64_t& pair_id, const order_side_t& side ) {
+        return order_tbl(self, pair_id * 10000 + uint64_t(order_side::index(side)));
+    }
+
+    /**
+     * the lean payload of orderchange, instead of a full order_t.
+     * the symbols of amounts are derived from symbol pair
+     */
+    struct order_event_t {
+        uint64_t        order_id;
+        uint64_t        ext_id;                 // external id, maps the order to the id of client
+        name            owner;
+        uint64_t        sympair_id;
+        uint8_t         order_side;             // index of order_side
+        int64_t         price;
+        int64_t         total_asset_amount;
+        int64_t         matched_asset_amount;
+
+        static order_event_t make(const order_t &order) {
+            order_event_t event;
+            event.order_id              = order.order_id;
+            event.ext_id                = order.ext_id;
+            event.owner                 = order.owner;
+            event.sympair_id            = order.sympair_id;
+            event.order_side            = order_side::index(order.order_side);
+            event.price                 = order.price.amount;
+            event.total_asset_amount    = order.total_asset_quant.amount;
+            event.matched_asset_amount  = order.matched_asset_quant.amount;
+            return event;
+        }
+
+        EOSLIB_SERIALIZE(order_event_t, (order_id)(ext_id)(owner)(sympair_id)(order_side)(price)
+                                        (total_asset_amount)(matched_asset_amount))
+    };
 
-    inline static order_tbl make_order_table(const name &self, const uint64_t& pair_id, const order_side_t& side ) { \
-                    return order_tbl(self, pair_id * 10000 + uint64_t(order_side::index(side))); \
-                }
-    
     inline static queue_tbl make_queue_table(const name &self) { return queue_tbl(self, self.value/*scope*/); }
+
+    //scope: order_side +  sympair_id, the same as order table
+    struct DEX_TABLE depth_t {
+        asset       price;
+        asset       quantity;           //!< total free asset quantity of orders at the price
+        uint32_t    order_count;        //!< count of orders at the price
+
+        uint64_t primary_key() const    { return price.amount; }
+
+        void print() const {
+            PRINT_PROPERTIES(
+                PP0(price),
+                PP(quantity),
+                PP(order_count)
+            );
+        }
+    };
+
+    typedef eosio::multi_index<"depth"_n, depth_t> depth_tbl;
+
+    inline static depth_tbl make_depth_table(const name &self, const uint64_t& pair_id, const order_side_t& side ) {
+        return depth_tbl(self, pair_id * 10000 + uint64_t(order_side::index(side)));
+    }
  
 
     struct DEX_TABLE deal_item_t {
@@ -341,7 +740,51 @@ namespace dex {
         uint64_t primary_key() const    { return id; }
     };
 
-    typedef eosio::multi_index<"deals"_n, deal_item_t> deal_tbl;
+    // the legacy deal table of full deal_item_t rows, only erased by prunedeals
+    typedef eosio::multi_index<"deals"_n, deal_item_t> legacy_deal_tbl;
+
+    /**
+     * the packed deal record, saved in deal table and sent by adddexdeal.
+     * the symbols of amounts are derived from symbol pair: buy_fee in asset symbol, sell_fee in coin symbol.
+     * the memo is saved once in deal memo table for all deals of one match, see deal_memo_t
+     */
+    struct DEX_TABLE packed_deal_t {
+        uint64_t    id;
+        uint64_t    sympair_id;
+        uint64_t    buy_order_id;
+        uint64_t    sell_order_id;
+        name        buyer;
+        name        seller;
+        int64_t     deal_asset_amount;
+        int64_t     deal_coin_amount;
+        int64_t     deal_price;
+        uint8_t     taker_side;             // index of order_side
+        int64_t     buy_fee;
+        int64_t     sell_fee;
+        int64_t     buy_refund_coin_amount;
+        uint64_t    memo_id;                //!< id of deal memo, 0 if no memo
+        time_point  deal_time;
+
+        uint64_t primary_key() const    { return id; }
+
+        EOSLIB_SERIALIZE(packed_deal_t, (id)(sympair_id)(buy_order_id)(sell_order_id)(buyer)(seller)
+                                        (deal_asset_amount)(deal_coin_amount)(deal_price)(taker_side)
+                                        (buy_fee)(sell_fee)(buy_refund_coin_amount)(memo_id)(deal_time))
+    };
+
+    typedef eosio::multi_index<"packeddeals"_n, packed_deal_t> deal_tbl;
+
+    // the memo of deals, the id is the first deal id of the match
+    struct DEX_TABLE deal_memo_t {
+        uint64_t    memo_id;
+        string      memo;
+
+        uint64_t primary_key() const    { return memo_id; }
+
+        EOSLIB_SERIALIZE(deal_memo_t, (memo_id)(memo))
+    };
+
+    typedef eosio::multi_index<"dealmemos"_n, deal_memo_t> deal_memo_tbl;
 
     struct DEX_TABLE rewards_t
     {
@@ -356,7 +799,68 @@ namespace dex {
         EOSLIB_SERIALIZE(rewards_t, (owner)(rewards))
     };
 
-    typedef eosio::multi_index<"rewards"_n, rewards_t> rewards_tbl;
+    // the legacy rewards table of one row per user, only read by the migreward action
+    typedef eosio::multi_index<"rewards"_n, rewards_t> legacy_rewards_tbl;
+
+    // the reward of one (owner, token), scope: self
+    struct DEX_TABLE reward_t
+    {
+        uint64_t        id;
+        name            owner;
+        extended_symbol ext_symbol;
+        uint64_t        amount;
+
+        uint64_t primary_key() const { return id; }
+        // the rows of owner are together, the contract of ext_symbol is checked on lookup
+        uint128_t by_owner_symbol() const { return make_uint128(owner.value, ext_symbol.get_symbol().raw()); }
+
+        EOSLIB_SERIALIZE(reward_t, (id)(owner)(ext_symbol)(amount))
+    };
+
+    using reward_owner_idx = indexed_by<"ownersym"_n, const_mem_fun<reward_t, uint128_t, &reward_t::by_owner_symbol> >;
+
+    typedef eosio::multi_index<"userrewards"_n, reward_t, reward_owner_idx> rewards_tbl;
+
+    // find the reward row of (owner, ext_symbol) in the ownersym index, return end() if not found
+    template<typename index_t>
+    inline static auto find_reward(index_t &reward_idx, const name &owner, const extended_symbol &ext_symbol) {
+        auto key = make_uint128(owner.value, ext_symbol.get_symbol().raw());
+        for (auto it = reward_idx.find(key); it != reward_idx.end() && it->by_owner_symbol() == key; it++) {
+            if (it->ext_symbol == ext_symbol) return it;
+        }
+        return reward_idx.end();
+    }
+
+    // the cached referral chain of user, read from the account creators
+    struct DEX_TABLE referral_t {
+        name    owner;
+        name    parent;     //!< creator of owner
+        name    grand;      //!< creator of parent
+
+        uint64_t primary_key() const { return owner.value; }
+
+        EOSLIB_SERIALIZE(referral_t, (owner)(parent)(grand))
+    };
+
+    typedef eosio::multi_index<"referrals"_n, referral_t> referral_tbl;
+
+    // the progress of the match action on symbol pair, a run lasts until the pair is not crossed
+    struct DEX_TABLE match_cursor_t {
+        uint64_t    sympair_id;
+        bool        pending;            //!< the order book is still crossed when the last match stopped
+        uint32_t    run_matched_count;  //!< the matched count of the current run
+        uint32_t    run_match_times;    //!< the match times of the current run
+        uint64_t    last_deal_id;       //!< the last deal id when the last match stopped
+        name        last_matcher;
+        time_point  updated_at;
+
+        uint64_t primary_key() const { return sympair_id; }
+
+        EOSLIB_SERIALIZE(match_cursor_t, (sympair_id)(pending)(run_matched_count)(run_match_times)
+                                         (last_deal_id)(last_matcher)(updated_at))
+    };
+
+    typedef eosio::multi_index<"matchcursor"_n, match_cursor_t> match_cursor_tbl;
 
 
     struct DEX_TABLE balance_chg_t
@@ -392,5 +896,8 @@ namespace dex {
 
     typedef eosio::multi_index<"sympair"_n, symbol_pair_t, symbols_idx> symbol_pair_table;
     inline static rewards_tbl make_reward_table(const name &self) { return rewards_tbl(self, self.value/*scope*/); }
+    inline static legacy_rewards_tbl make_legacy_reward_table(const name &self) { return legacy_rewards_tbl(self, self.value/*scope*/); }
+    inline static referral_tbl make_referral_table(const name &self) { return referral_tbl(self, self.value/*scope*/); }
+    inline static match_cursor_tbl make_match_cursor_table(const name &self) { return match_cursor_tbl(self, self.value/*scope*/); }
 
 }// namespace dex
\ No newline at end of file
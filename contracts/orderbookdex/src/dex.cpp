@@ -7,14 +7,19 @@
 
 static constexpr eosio::name active_permission{"active"_n};
 
-#define ADD_DEAL_ACTION( items, curr) \
-     { dex_contract::deal_action act{ _self, { {_self, active_permission} } };\
-	        act.send( items, curr );}
+// no notification for the empty deal batch
+#define ADD_DEAL_ACTION( items, memo, curr) \
+     { if (!items.empty()) { dex_contract::deal_action act{ _self, { {_self, active_permission} } };\
+	        act.send( items, memo, curr );} }
 
 
-#define ORDERCHANGE_ACTION( queue_order_id, order) \
+#define ORDERCHANGE_ACTION( order) \
      { dex_contract::orderchange_action act{ _self, { {_self, active_permission} } };\
-	        act.send( queue_order_id, order );}
+	        act.send( dex::order_event_t::make(order) );}
+
+#define BALANCECHG_ACTION( change) \
+     { dex_contract::balancechg_action act{ _self, { {_self, active_permission} } };\
+	        act.send( change );}
 
 using namespace eosio;
 using namespace std;
@@ -50,6 +55,11 @@ ACTION dex_contract::init() {
     conf.parent_reward_ratio        = 10;
     conf.grand_reward_ratio         = 5;
     conf.apl_farm_id                 = 0;
+    conf.balance_log_mode           = balance_log_mode::FULL;
+    conf.balance_log_size           = 0;
+    conf.deal_retain_count          = 0;
+    conf.deal_retain_secs           = 0;
+    conf.entry_taker_only           = false;
 
     conf.support_quote_symbols.insert(extended_symbol(SYS_TOKEN, SYS_ACCOUNT));
     conf.support_quote_symbols.insert(extended_symbol(MIRROR_USDT, MIRROR_BANK));
@@ -67,6 +77,10 @@ void dex_contract::setconfig(const dex::config &conf) {
     CHECKC( conf.max_match_count >  0,          err::PARAM_ERROR,       "The max_match_count must be bigger than 0");
     validate_fee_ratio( conf.maker_fee_ratio,   "maker_fee_ratio");
     validate_fee_ratio( conf.taker_fee_ratio,   "taker_fee_ratio");
+    auto log_mode = conf.balance_log_mode.value_or();
+    CHECKC( log_mode.value == 0 || balance_log_mode::is_valid(log_mode), err::PARAM_ERROR, "Invalid balance_log_mode=" + log_mode.to_string());
+    CHECKC( log_mode != balance_log_mode::RING || conf.balance_log_size.value_or() > 0, err::PARAM_ERROR,
+        "The balance_log_size must be bigger than 0 in ring mode");
 
     _conf_tbl.set(conf, get_self());
 }
@@ -76,7 +90,7 @@ void dex_contract::setsympair(const extended_symbol&    asset_symbol,
                               const asset&              min_asset_quant,
                               const asset&              min_coin_quant,
                               bool                      enabled) {
-    require_auth( _config.dex_admin );
+    require_auth( get_config().dex_admin );
     const auto &asset_sym = asset_symbol.get_symbol();
     const auto &coin_sym = coin_symbol.get_symbol();
     auto sympair_tbl = make_sympair_table(get_self());
@@ -94,7 +108,7 @@ void dex_contract::setsympair(const extended_symbol&    asset_symbol,
     auto it = index.find( make_symbols_idx(asset_symbol, coin_symbol));
     if (it == index.end()) {
         // new sym pair
-        auto sympair_id = _global->new_sympair_id();
+        auto sympair_id = get_global().new_sympair_id();
         CHECKC( sympair_tbl.find(sympair_id) == sympair_tbl.end(), err::RECORD_NOT_FOUND, "The symbol pair id exist");
         sympair_tbl.emplace(get_self(), [&](auto &sym_pair) {
             sym_pair.sympair_id          = sympair_id;
@@ -103,6 +117,8 @@ void dex_contract::setsympair(const extended_symbol&    asset_symbol,
             sym_pair.min_asset_quant      = min_asset_quant;
             sym_pair.min_coin_quant       = min_coin_quant;
             sym_pair.enabled              = enabled;
+            sym_pair.best_bid_price       = asset(0, coin_sym);
+            sym_pair.best_ask_price       = asset(0, coin_sym);
         });
     } else {
         CHECKC(it->asset_symbol == asset_symbol,    err::SYMBOL_MISMATCH,  "The asset_symbol mismatch with the existed one");
@@ -116,7 +132,7 @@ void dex_contract::setsympair(const extended_symbol&    asset_symbol,
 }
 
 void dex_contract::onoffsympair(const uint64_t& sympair_id, const bool& on_off) {
-    require_auth( _config.dex_admin );
+    require_auth( get_config().dex_admin );
 
     auto sympair_tbl = make_sympair_table(_self);
     auto it = sympair_tbl.find(sympair_id);
@@ -127,12 +143,16 @@ void dex_contract::onoffsympair(const uint64_t& sympair_id, const bool& on_off)
 }
 
 void dex_contract::delsympair(const uint64_t& sympair_id) {
-    require_auth( _config.dex_admin );
+    require_auth( get_config().dex_admin );
 
     auto sympair_tbl = make_sympair_table(_self);
     auto it = sympair_tbl.find(sympair_id);
     CHECKC( it != sympair_tbl.end(),            err::RECORD_NOT_FOUND, "sympair not found: " + to_string(sympair_id) )
     sympair_tbl.erase(it);
+
+    auto cursor_tbl = make_match_cursor_table(_self);
+    auto cursor_it = cursor_tbl.find(sympair_id);
+    if (cursor_it != cursor_tbl.end()) cursor_tbl.erase(cursor_it);
 }
 
 
@@ -142,10 +162,78 @@ void dex_contract::ontransfer(const name& from, const name& to, const asset& qua
     CHECKC( to == get_self(),                   err::PARAM_ERROR, "Must transfer to this contract")
     CHECKC( quant.amount > 0,                   err::PARAM_ERROR, "The quantity must be positive")
 
+    auto params = split(memo, ":");
+    if (params[0] == "order") {
+        // memo: order:<sympair_id>:<side>:<quantity>:<price>:<ext_id>[:<time_in_force>]
+        CHECKC( params.size() == 6 || params.size() == 7, err::MEMO_FORMAT_ERROR,
+            "Invalid memo format, expected: order:<sympair_id>:<side>:<quantity>:<price>:<ext_id>[:<time_in_force>]")
+        if (get_config().admin_sign_required) { require_auth(get_config().dex_admin); }
+
+        auto sympair_id = parse_uint64(params[1]);
+        auto order_side = name(params[2]);
+        CHECKC( order_side::is_valid(order_side),   err::PARAM_ERROR, "Invalid order_side=" + order_side.to_string())
+
+        auto sympair_tbl = make_sympair_table(get_self());
+        auto sym_pair_it = sympair_tbl.find(sympair_id);
+        CHECKC( sym_pair_it != sympair_tbl.end(),   err::RECORD_NOT_FOUND, "The symbol pair id '" + std::to_string(sympair_id) + "' does not exist")
+        CHECKC( sym_pair_it->enabled,               err::STATUS_ERROR, "The symbol pair '" + std::to_string(sympair_id) + " is disabled")
+
+        auto order = make_order(from, *sym_pair_it, order_side, asset_from_string(params[3]), asset_from_string(params[4]),
+                                parse_uint64(params[5]), get_config().taker_fee_ratio, get_config().maker_fee_ratio,
+                                params.size() == 7 ? name(params[6]) : order_tif::GTC);
+        check_frozen_quant(*sym_pair_it, order, quant);
+        place_order(*sym_pair_it, order);
+        return;
+    }
+
+    if (params[0] == "market") {
+        // memo: market:<sympair_id>:<side>:<ext_id>
+        // the transferred quantity is the budget, coins for buy order or assets for sell order
+        CHECKC( params.size() == 4, err::MEMO_FORMAT_ERROR,
+            "Invalid memo format, expected: market:<sympair_id>:<side>:<ext_id>")
+        if (get_config().admin_sign_required) { require_auth(get_config().dex_admin); }
+
+        auto sympair_id = parse_uint64(params[1]);
+        auto order_side = name(params[2]);
+        CHECKC( order_side::is_valid(order_side),   err::PARAM_ERROR, "Invalid order_side=" + order_side.to_string())
+
+        auto sympair_tbl = make_sympair_table(get_self());
+        auto sym_pair_it = sympair_tbl.find(sympair_id);
+        CHECKC( sym_pair_it != sympair_tbl.end(),   err::RECORD_NOT_FOUND, "The symbol pair id '" + std::to_string(sympair_id) + "' does not exist")
+        CHECKC( sym_pair_it->enabled,               err::STATUS_ERROR, "The symbol pair '" + std::to_string(sympair_id) + " is disabled")
+
+        auto order = make_order(from, *sym_pair_it, order_side, quant, std::nullopt, parse_uint64(params[3]),
+                                get_config().taker_fee_ratio, get_config().maker_fee_ratio, order_tif::IOC);
+        check_frozen_quant(*sym_pair_it, order, quant);
+        place_order(*sym_pair_it, order);
+        return;
+    }
+
+    if (params[0] == "amend") {
+        // memo: amend:<sympair_id>:<side>:<order_id>:<remaining_quant>:<price>
+        CHECKC( params.size() == 6, err::MEMO_FORMAT_ERROR,
+            "Invalid memo format, expected: amend:<sympair_id>:<side>:<order_id>:<remaining_quant>:<price>")
+        amend_order(from, parse_uint64(params[1]), name(params[2]), parse_uint64(params[3]),
+                    asset_from_string(params[4]), asset_from_string(params[5]), quant);
+        return;
+    }
+
     auto queue_tbl = make_queue_table(get_self());
-    auto queue_owner_idx = queue_tbl.get_index<"orderowner"_n>();
-    auto order_itr = queue_owner_idx.find(from.value);
-    CHECKC( order_itr != queue_owner_idx.end(), err::PARAM_ERROR, "The order not in queue: from=" + from.to_string());
+    auto queue_owner_idx = queue_tbl.get_index<"ownerorder"_n>();
+    auto order_itr = queue_owner_idx.end();
+    if (params[0] == "queue") {
+        // memo: queue:<queue_order_id>
+        CHECKC( params.size() == 2, err::MEMO_FORMAT_ERROR, "Invalid memo format, expected: queue:<queue_order_id>")
+        auto queue_order_id = parse_uint64(params[1]);
+        order_itr = queue_owner_idx.find(make_uint128(from.value, queue_order_id));
+        CHECKC( order_itr != queue_owner_idx.end(), err::RECORD_NOT_FOUND,
+            "The order not in queue: from=" + from.to_string() + ", queue_order_id=" + std::to_string(queue_order_id));
+    } else {
+        // the earliest queued order of user
+        order_itr = queue_owner_idx.lower_bound(make_uint128(from.value, 0));
+        CHECKC( order_itr != queue_owner_idx.end() && order_itr->owner == from, err::PARAM_ERROR,
+            "The order not in queue: from=" + from.to_string());
+    }
 
     auto sympair_tbl = make_sympair_table(get_self());
     auto sympair_id = order_itr->sympair_id;
@@ -153,68 +241,343 @@ void dex_contract::ontransfer(const name& from, const name& to, const asset& qua
     CHECKC( sym_pair_it != sympair_tbl.end(),   err::RECORD_NOT_FOUND, "The symbol pair id '" + std::to_string(sympair_id) + "' does not exist")
     CHECKC( sym_pair_it->enabled,               err::STATUS_ERROR, "The symbol pair '" + std::to_string(sympair_id) + " is disabled")
 
-    const auto &asset_symbol = sym_pair_it->asset_symbol.get_symbol();
-    const auto &coin_symbol = sym_pair_it->coin_symbol.get_symbol();
+    auto order = *order_itr;
+    check_frozen_quant(*sym_pair_it, order, quant);
+    queue_owner_idx.erase(order_itr);
 
-    name frozen_bank = (order_itr->order_side == dex::order_side::BUY) ? sym_pair_it->coin_symbol.get_contract() :
-            sym_pair_it->asset_symbol.get_contract();
+    place_order(*sym_pair_it, order);
+}
+
+void dex_contract::check_frozen_quant(const dex::symbol_pair_t &sym_pair, const dex::order_t &order, const asset &quant) {
+    name frozen_bank = (order.order_side == dex::order_side::BUY) ? sym_pair.coin_symbol.get_contract() :
+            sym_pair.asset_symbol.get_contract();
 
     CHECKC( frozen_bank == get_first_receiver(),    err::PARAM_ERROR, "order asset must transfer from : " + frozen_bank.to_string() )
-    CHECKC( order_itr->total_frozen_quant == quant,       err::STATUS_ERROR, "require quantity is " + order_itr->total_frozen_quant.to_string() )
+    CHECKC( order.total_frozen_quant == quant,      err::STATUS_ERROR, "require quantity is " + order.total_frozen_quant.to_string() )
+}
 
-    auto order_tbl = make_order_table( get_self(), order_itr->sympair_id, order_itr->order_side );
-    auto order_id = _global->new_order_id();
-    TRACE_L ( "order_tbl, order_id:", order_id);
+/**
+ * put the funded order into order book and match it,
+ * or match the immediate order at once without putting it into order book
+*/
+void dex_contract::place_order(const dex::symbol_pair_t &sym_pair, dex::order_t &order) {
+    const auto opposite_price = (order.order_side == order_side::BUY) ? sym_pair.get_best_ask_price() : sym_pair.get_best_bid_price();
+    bool order_crossed = (order.order_type == order_type::MARKET) ? opposite_price.amount > 0 :
+                         (order.order_side == order_side::BUY) ? is_price_crossed(order.price, opposite_price) :
+                                                                  is_price_crossed(opposite_price, order.price);
+    CHECKC( order.time_in_force != order_tif::POSTONLY || !order_crossed, err::STATUS_ERROR,
+        "The post-only order would be matched at once")
+
+    auto order_id = _pair_seqs.new_order_id(order.sympair_id);
+    order.order_id = order_id;
+
+    if (order_tif::is_immediate(order.time_in_force)) {
+        CHECKC( get_config().max_match_count > 0 && order_crossed, err::STATUS_ERROR, "The immediate order can not be matched")
+        if (order.time_in_force == order_tif::FOK) {
+            check_fill_or_kill(order);
+        }
+        uint32_t matched_count = 0;
+        match_sympair(get_self(), sym_pair, get_config().max_match_count, matched_count, "oid:" + std::to_string(order_id), &order);
+        CHECKC( order.time_in_force != order_tif::FOK || order.matched_asset_quant == order.total_asset_quant,
+            err::STATUS_ERROR, "The fill-or-kill order can not be fully matched")
+        if (order.order_type == order_type::MARKET && order.order_side == order_side::BUY) {
+            // the market buy order is done with the bought assets
+            order.total_asset_quant = order.matched_asset_quant;
+        }
+        ORDERCHANGE_ACTION(order);
+        return;
+    }
 
-    // auto _index=     order_tbl.get_index<"orderprice"_n>();
+    auto order_tbl = make_order_table( get_self(), order.sympair_id, order.order_side );
+    TRACE_L ( "order_tbl, order_id:", order_id);
 
     order_tbl.emplace(_self, [&](auto &order_info) {
-        order_info          = *order_itr;
-        order_info.order_id = order_id;
+        order_info          = packed_order_t::pack(order);
     });
-    queue_owner_idx.erase(order_itr);
+    update_depth(sym_pair, order.order_side, order.price.amount,
+                 { (order.total_asset_quant - order.matched_asset_quant).amount, 1 });
 
-    ORDERCHANGE_ACTION(order_id, *order_itr);
+    ORDERCHANGE_ACTION(order);
 
-    
-    TRACE_L( "match_sympair begin  ", _config.max_match_count);
+    auto best_bid_price = sym_pair.get_best_bid_price();
+    auto best_ask_price = sym_pair.get_best_ask_price();
+    if (order.order_side == order_side::BUY) {
+        if (best_bid_price.amount == 0 || order.price.amount > best_bid_price.amount) best_bid_price = order.price;
+    } else {
+        if (best_ask_price.amount == 0 || order.price.amount < best_ask_price.amount) best_ask_price = order.price;
+    }
 
-    if (_config.max_match_count > 0) {
+    // in taker only mode, the crosses left by other orders are matched by the match action
+    bool crossed = !get_config().entry_taker_only.value_or() ? is_price_crossed(best_bid_price, best_ask_price) :
+                   (order.order_side == order_side::BUY) ? is_price_crossed(order.price, best_ask_price) :
+                                                            is_price_crossed(best_bid_price, order.price);
+
+    TRACE_L( "match_sympair begin  ", get_config().max_match_count);
+
+    if (get_config().max_match_count > 0 && crossed) {
         uint32_t matched_count = 0;
-        TRACE_L( "match_sympair check max_match_count ", _config.max_match_count);
+        TRACE_L( "match_sympair check max_match_count ", get_config().max_match_count);
         
-        match_sympair(get_self(), *sym_pair_it, _config.max_match_count, matched_count, "oid:" + std::to_string(order_id));
+        // match_sympair saves the best prices left in order book
+        match_sympair(get_self(), sym_pair, get_config().max_match_count, matched_count, "oid:" + std::to_string(order_id),
+                      get_config().entry_taker_only.value_or() ? &order : nullptr);
+    } else {
+        update_sympair_prices(sym_pair.sympair_id, best_bid_price, best_ask_price, asset());
     }
 }
 
+/**
+ * check the crossed orders of opposite side can fully match the order within max_match_count
+*/
+void dex_contract::check_fill_or_kill(const dex::order_t &order) {
+    auto opposite_side = (order.order_side == order_side::BUY) ? order_side::SELL : order_side::BUY;
+    auto order_tbl = make_order_table(get_self(), order.sympair_id, opposite_side);
+    auto price_idx = order_tbl.get_index<"priceorder"_n>();
+    int64_t free_amount = 0;
+    uint32_t count = 0;
+    for (auto it = price_idx.begin(); it != price_idx.end() && count < get_config().max_match_count
+            && free_amount < order.total_asset_quant.amount; ++it, ++count) {
+        bool crossed = (order.order_side == order_side::BUY) ? it->price <= order.price.amount :
+                                                               it->price >= order.price.amount;
+        if (!crossed) break;
+        free_amount += it->total_asset_amount - it->matched_asset_amount;
+    }
+    CHECKC( free_amount >= order.total_asset_quant.amount, err::STATUS_ERROR, "The fill-or-kill order can not be fully matched")
+}
+
 void dex_contract::cancel(const uint64_t& pair_id, const name& side, const uint64_t &order_id) {
     CHECK_DEX_ENABLED()
     auto order_tbl = make_order_table(get_self(), pair_id, side);
     auto it = order_tbl.find(order_id);
     CHECKC(it != order_tbl.end(), err::RECORD_NOT_FOUND, "The order does not exist or has been matched");
-    auto order = *it;
     // TODO: support the owner auth to cancel order?
-    require_auth(order.owner);
+    require_auth(it->owner);
 
     auto sympair_tbl = make_sympair_table(get_self());
-    auto sym_pair_it = sympair_tbl.find(order.sympair_id);
+    auto sym_pair_it = sympair_tbl.find(pair_id);
     CHECKC( sym_pair_it != sympair_tbl.end(), err::RECORD_NOT_FOUND,
-        "The symbol pair id '" + std::to_string(order.sympair_id) + "' does not exist");
-    CHECKC( sym_pair_it->enabled,  err::STATUS_ERROR,    "The symbol pair '" + std::to_string(order.sympair_id) + " is disabled")
+        "The symbol pair id '" + std::to_string(pair_id) + "' does not exist");
+    CHECKC( sym_pair_it->enabled,  err::STATUS_ERROR,    "The symbol pair '" + std::to_string(pair_id) + " is disabled")
+    auto order = it->unpack(*sym_pair_it);
+
+    settlements_t refunds;
+    unfreeze_order(*sym_pair_it, order, refunds);
+    order_tbl.erase(it);
+    refund_orders(refunds, "order cancel: " + to_string(order_id));
+
+    const auto best_price = (order.order_side == order_side::BUY) ? sym_pair_it->get_best_bid_price() : sym_pair_it->get_best_ask_price();
+    if (order.price.amount == best_price.amount) {
+        // the canceled order may be the last one on top of book
+        refresh_best_price(order.sympair_id, order.order_side);
+    }
+}
+
+void dex_contract::cancelmany(const vector<dex::cancel_param_t>& orders) {
+    CHECK_DEX_ENABLED()
+    CHECKC( !orders.empty() && orders.size() <= DEX_BATCH_ORDERS_MAX, err::OVERSIZED,
+        "The order count must be in [1, " + std::to_string(DEX_BATCH_ORDERS_MAX) + "]")
+
+    auto sympair_tbl = make_sympair_table(get_self());
+    settlements_t refunds;
+    // (sympair_id, order_side) of the canceled orders on top of book
+    std::set<std::pair<uint64_t, name>> top_changes;
+    for (const auto &param : orders) {
+        CHECKC( order_side::is_valid(param.order_side), err::PARAM_ERROR, "Invalid order_side=" + param.order_side.to_string())
+        auto order_tbl = make_order_table(get_self(), param.sympair_id, param.order_side);
+        auto it = order_tbl.find(param.order_id);
+        CHECKC( it != order_tbl.end(), err::RECORD_NOT_FOUND,
+            "The order does not exist or has been matched: " + std::to_string(param.order_id));
+        require_auth(it->owner);
+
+        auto sym_pair_it = sympair_tbl.find(param.sympair_id);
+        CHECKC( sym_pair_it != sympair_tbl.end(), err::RECORD_NOT_FOUND,
+            "The symbol pair id '" + std::to_string(param.sympair_id) + "' does not exist");
+        CHECKC( sym_pair_it->enabled,  err::STATUS_ERROR,    "The symbol pair '" + std::to_string(param.sympair_id) + " is disabled")
+
+        unfreeze_order(*sym_pair_it, it->unpack(*sym_pair_it), refunds);
+        const auto best_price = (param.order_side == order_side::BUY) ? sym_pair_it->get_best_bid_price() : sym_pair_it->get_best_ask_price();
+        if (it->price == best_price.amount) top_changes.insert({param.sympair_id, param.order_side});
+        order_tbl.erase(it);
+    }
+
+    refund_orders(refunds, "orders cancel: " + to_string(orders.size()));
+    for (const auto &change : top_changes) {
+        refresh_best_price(change.first, change.second);
+    }
+}
+
+void dex_contract::cancelall(const name& owner, const optional<uint64_t>& pair_id) {
+    CHECK_DEX_ENABLED()
+    require_auth(owner);
+
+    auto sympair_tbl = make_sympair_table(get_self());
+    auto sym_pair_it = sympair_tbl.begin();
+    if (pair_id) {
+        sym_pair_it = sympair_tbl.find(*pair_id);
+        CHECKC( sym_pair_it != sympair_tbl.end(), err::RECORD_NOT_FOUND,
+            "The symbol pair id '" + std::to_string(*pair_id) + "' does not exist");
+        CHECKC( sym_pair_it->enabled,  err::STATUS_ERROR,    "The symbol pair '" + std::to_string(*pair_id) + " is disabled")
+    }
+
+    settlements_t refunds;
+    std::set<std::pair<uint64_t, name>> top_changes;
+    uint32_t canceled_count = 0;
+    for (; sym_pair_it != sympair_tbl.end() && canceled_count < DEX_BATCH_ORDERS_MAX; ++sym_pair_it) {
+        if (sym_pair_it->enabled) {
+            for (const auto &side : { order_side::BUY, order_side::SELL }) {
+                auto order_tbl = make_order_table(get_self(), sym_pair_it->sympair_id, side);
+                auto owner_idx = order_tbl.get_index<"orderowner"_n>();
+                const auto best_price = (side == order_side::BUY) ? sym_pair_it->get_best_bid_price() : sym_pair_it->get_best_ask_price();
+                auto it = owner_idx.lower_bound(owner.value);
+                while (it != owner_idx.end() && it->owner == owner && canceled_count < DEX_BATCH_ORDERS_MAX) {
+                    unfreeze_order(*sym_pair_it, it->unpack(*sym_pair_it), refunds);
+                    if (it->price == best_price.amount) top_changes.insert({sym_pair_it->sympair_id, side});
+                    it = owner_idx.erase(it);
+                    canceled_count++;
+                }
+            }
+        }
+        if (pair_id) break;
+    }
+    CHECKC( canceled_count > 0, err::RECORD_NOT_FOUND, "None canceled")
+
+    refund_orders(refunds, "orders cancel: " + to_string(canceled_count));
+    for (const auto &change : top_changes) {
+        refresh_best_price(change.first, change.second);
+    }
+}
+
+void dex_contract::amend(const name& owner, const uint64_t& pair_id, const name& side, const uint64_t& order_id,
+                         const asset& remaining_quant, const asset& price) {
+    CHECK_DEX_ENABLED()
+    require_auth(owner);
+    amend_order(owner, pair_id, side, order_id, remaining_quant, price, asset());
+}
+
+/**
+ * amend the resting order, paid_quant is the transferred top-up of frozen funds, or 0 if none
+*/
+void dex_contract::amend_order(const name& owner, const uint64_t& pair_id, const name& side, const uint64_t& order_id,
+                               const asset& remaining_quant, const asset& price, const asset& paid_quant) {
+    // the amended order may be placed again, so it is authorized the same as a new order
+    if (get_config().admin_sign_required) { require_auth(get_config().dex_admin); }
+    CHECKC( order_side::is_valid(side),         err::PARAM_ERROR, "Invalid order_side=" + side.to_string())
+    auto order_tbl = make_order_table(get_self(), pair_id, side);
+    auto it = order_tbl.find(order_id);
+    CHECKC( it != order_tbl.end(),              err::RECORD_NOT_FOUND, "The order does not exist or has been matched");
+    CHECKC( it->owner == owner,                 err::NO_AUTH, "The order is not owned by " + owner.to_string());
+
+    auto sympair_tbl = make_sympair_table(get_self());
+    auto sym_pair_it = sympair_tbl.find(pair_id);
+    CHECKC( sym_pair_it != sympair_tbl.end(),   err::RECORD_NOT_FOUND,
+        "The symbol pair id '" + std::to_string(pair_id) + "' does not exist");
+    CHECKC( sym_pair_it->enabled,               err::STATUS_ERROR, "The symbol pair '" + std::to_string(pair_id) + " is disabled")
 
+    const auto &asset_symbol    = sym_pair_it->asset_symbol.get_symbol();
+    const auto &coin_symbol     = sym_pair_it->coin_symbol.get_symbol();
+    CHECKC( remaining_quant.symbol == asset_symbol, err::SYMBOL_MISMATCH, "The remaining_quant symbol mismatch with asset_symbol")
+    CHECKC( remaining_quant.amount > 0,         err::NOT_POSITIVE, "The remaining_quant must > 0")
+    CHECKC( price.symbol == coin_symbol,        err::SYMBOL_MISMATCH, "The price symbol mismatch with coin_symbol")
+    CHECKC( price.amount > 0,                   err::NOT_POSITIVE, "The price must > 0")
+
+    const auto old_order = it->unpack(*sym_pair_it);
+    auto order = old_order;
+    auto old_remaining_quant = order.total_asset_quant - order.matched_asset_quant;
+    CHECKC( price != order.price || remaining_quant != old_remaining_quant, err::ACTION_REDUNDANT, "Nothing changed")
+
+    order.total_asset_quant = order.matched_asset_quant + remaining_quant;
+    order.price             = price;
+    order.last_updated_at   = current_block_time();
+    name frozen_bank;
+    if (side == order_side::BUY) {
+        order.total_frozen_quant = order.matched_coin_quant + calc_coin_quant(remaining_quant, price, coin_symbol);
+        frozen_bank = sym_pair_it->coin_symbol.get_contract();
+    } else { // side == order_side::SELL
+        order.total_frozen_quant = order.total_asset_quant;
+        frozen_bank = sym_pair_it->asset_symbol.get_contract();
+    }
+    // the frozen funds to add if positive, or to refund if negative
+    auto frozen_delta = order.total_frozen_quant - old_order.total_frozen_quant;
+    if (paid_quant.amount > 0) {
+        CHECKC( frozen_bank == get_first_receiver(), err::PARAM_ERROR, "order asset must transfer from : " + frozen_bank.to_string() )
+        CHECKC( paid_quant.symbol == frozen_delta.symbol && paid_quant.amount == frozen_delta.amount, err::STATUS_ERROR,
+            "require quantity is " + frozen_delta.to_string() )
+    } else {
+        CHECKC( frozen_delta.amount <= 0,       err::STATUS_ERROR,
+            "The amended order requires more frozen quantity=" + frozen_delta.to_string() + ", transfer it with amend memo" )
+    }
+
+    if (frozen_delta.amount < 0) {
+        add_balance(owner, frozen_bank, -frozen_delta, balance_type::orderrefund, "order amend: " + to_string(order_id));
+    }
+
+    if (price == old_order.price && remaining_quant <= old_remaining_quant) {
+        // shrink in place, the order keeps its priority
+        order_tbl.modify(it, same_payer, [&](auto &row) {
+            row = packed_order_t::pack(order);
+        });
+        update_depth(*sym_pair_it, side, price.amount, { (remaining_quant - old_remaining_quant).amount, 0 });
+        ORDERCHANGE_ACTION(order);
+        return;
+    }
+
+    // otherwise move the order to the end of its new price level
+    const auto &old_price = old_order.price;
+    order_tbl.erase(it);
+    update_depth(*sym_pair_it, side, old_price.amount, { -old_remaining_quant.amount, -1 });
+    const auto best_price = (side == order_side::BUY) ? sym_pair_it->get_best_bid_price() : sym_pair_it->get_best_ask_price();
+    if (old_price.amount == best_price.amount) {
+        refresh_best_price(pair_id, side);
+    }
+    // the best prices in the cached row of sympair_tbl are stale after refresh
+    auto placed_sympair_tbl = make_sympair_table(get_self());
+    place_order(placed_sympair_tbl.get(pair_id), order);
+}
+
+/**
+ * add the unmatched frozen quantity of order to refunds, and remove the order from depth
+*/
+void dex_contract::unfreeze_order(const dex::symbol_pair_t &sym_pair, const dex::order_t &order, dex::settlements_t &refunds) {
     asset quantity;
-    name bank;
+    const extended_symbol *frozen_symbol;
     if (order.order_side == order_side::BUY) {
         quantity = order.total_frozen_quant - order.matched_coin_quant;
-        bank = sym_pair_it->coin_symbol.get_contract();
+        frozen_symbol = &sym_pair.coin_symbol;
     } else { // order.order_side == order_side::SELL
         quantity = order.total_frozen_quant - order.matched_asset_quant;
-        bank = sym_pair_it->asset_symbol.get_contract();
+        frozen_symbol = &sym_pair.asset_symbol;
     }
     CHECKC(quantity.amount >= 0, err::PARAM_ERROR, "Can not unfreeze the invalid quantity=" + quantity.to_string());
-    
-    add_balance(order.owner, bank, quantity, balance_type::ordercancel, "order cancel: " + to_string(order_id));
-    order_tbl.erase(it);
+
+    refunds[{order.owner, *frozen_symbol}] += quantity.amount;
+    update_depth(sym_pair, order.order_side, order.price.amount,
+                 { -(order.total_asset_quant - order.matched_asset_quant).amount, -1 });
+}
+
+void dex_contract::refund_orders(const dex::settlements_t &refunds, const string &memo) {
+    for (const auto &refund : refunds) {
+        if (refund.second <= 0) continue;
+        const auto &ext_sym = refund.first.second;
+        add_balance(refund.first.first, ext_sym.get_contract(), asset(refund.second, ext_sym.get_symbol()),
+                    balance_type::ordercancel, memo);
+    }
+}
+
+/**
+ * read the top price of order side from order book, and save it to sym_pair
+*/
+void dex_contract::refresh_best_price(const uint64_t& sympair_id, const name &side) {
+    auto sympair_tbl = make_sympair_table(get_self());
+    const auto &sym_pair = sympair_tbl.get(sympair_id);
+    auto order_tbl = make_order_table(get_self(), sympair_id, side);
+    auto price_idx = order_tbl.get_index<"priceorder"_n>();
+    auto top_it = price_idx.begin();
+
+    auto best_bid_price = sym_pair.get_best_bid_price();
+    auto best_ask_price = sym_pair.get_best_ask_price();
+    auto &best_price = (side == order_side::BUY) ? best_bid_price : best_ask_price;
+    best_price = asset((top_it != price_idx.end()) ? top_it->price : 0, sym_pair.coin_symbol.get_symbol());
+    update_sympair_prices(sympair_id, best_bid_price, best_ask_price, asset());
 }
 
 dex::config dex_contract::get_default_config() {
@@ -241,21 +604,198 @@ void dex_contract::match(const name &matcher, const uint64_t& sympair_id, uint32
     CHECKC(sym_pair_it != sympair_tbl.end(),    err::PARAM_ERROR,  "The symbol pair=" + std::to_string(sympair_id) + " does not exist");
     CHECKC(sym_pair_it->enabled,                err::STATUS_ERROR, "The indicated sym_pair=" + std::to_string(sympair_id) + " is disabled");
 
+    auto cursor_tbl = make_match_cursor_table(get_self());
+    auto cursor_it = cursor_tbl.find(sympair_id);
+    bool was_pending = cursor_it != cursor_tbl.end() && cursor_it->pending;
+
     uint32_t matched_count = 0;
-    match_sympair(matcher, *sym_pair_it, max_count, matched_count, memo);
-    CHECKC(matched_count > 0,  err::PARAM_ERROR, "None matched");
+    if (sym_pair_it->is_crossed()) {
+        match_sympair(matcher, *sym_pair_it, max_count, matched_count, memo);
+    }
+    // a pending run may be finished by the matching of new orders, then close it
+    CHECKC(matched_count > 0 || was_pending,  err::PARAM_ERROR, "None matched");
+
+    save_match_cursor(cursor_tbl, matcher, sympair_id, matched_count);
+}
+
+void dex_contract::matchmany(const name &matcher, const vector<uint64_t>& pair_ids, uint32_t total_budget, const string &memo) {
+    CHECK_DEX_ENABLED()
+
+    CHECKC(is_account(matcher),                 err::ACCOUNT_INVALID, "The matcher account does not exist");
+    CHECKC(total_budget > 0,                    err::PARAM_ERROR, "The total_budget must > 0")
+    CHECKC(!pair_ids.empty() && pair_ids.size() <= DEX_MATCH_PAIRS_MAX, err::OVERSIZED,
+        "The pair count must be in [1, " + std::to_string(DEX_MATCH_PAIRS_MAX) + "]")
+
+    auto sympair_tbl = make_sympair_table(get_self());
+    auto cursor_tbl = make_match_cursor_table(get_self());
+    // (last matched time, pair id) of crossed pairs, the least recently matched pair goes first
+    std::set<std::pair<time_point, uint64_t>> crossed_pairs;
+    std::set<uint64_t> pair_set;
+    for (const auto &pair_id : pair_ids) {
+        CHECKC(pair_set.insert(pair_id).second,  err::PARAM_ERROR, "Duplicated pair_id=" + std::to_string(pair_id))
+        auto sym_pair_it = sympair_tbl.find(pair_id);
+        CHECKC(sym_pair_it != sympair_tbl.end(), err::PARAM_ERROR, "The symbol pair=" + std::to_string(pair_id) + " does not exist");
+        if (!sym_pair_it->enabled || !sym_pair_it->is_crossed()) continue;
+
+        auto cursor_it = cursor_tbl.find(pair_id);
+        crossed_pairs.insert({ cursor_it != cursor_tbl.end() ? cursor_it->updated_at : time_point(), pair_id });
+    }
+
+    uint32_t budget = total_budget;
+    std::map<uint64_t, uint32_t> matched_counts;
+    while (budget > 0 && !crossed_pairs.empty()) {
+        uint32_t share = std::max<uint32_t>(1, budget / crossed_pairs.size());
+        auto it = crossed_pairs.begin();
+        while (budget > 0 && it != crossed_pairs.end()) {
+            // the best prices in the cached rows of sympair_tbl are stale after matching
+            auto round_sympair_tbl = make_sympair_table(get_self());
+            auto sympair_it = round_sympair_tbl.find(it->second);
+            uint32_t matched_count = 0;
+            if (sympair_it->is_crossed()) {
+                match_sympair(matcher, *sympair_it, std::min(share, budget), matched_count, memo);
+                budget -= matched_count;
+                matched_counts[it->second] += matched_count;
+            }
+            // keep the pair in next round if it is still crossed after using up its share
+            it = (matched_count == share) ? std::next(it) : crossed_pairs.erase(it);
+        }
+    }
+    CHECKC(!matched_counts.empty(),             err::PARAM_ERROR, "None matched");
+
+    for (const auto &matched : matched_counts) {
+        save_match_cursor(cursor_tbl, matcher, matched.first, matched.second);
+    }
+}
+
+void dex_contract::save_match_cursor(dex::match_cursor_tbl &cursor_tbl, const name &matcher, const uint64_t& sympair_id,
+                                     uint32_t matched_count) {
+    auto set_cursor = [&](auto &cursor) {
+        if (!cursor.pending) {
+            cursor.run_matched_count    = 0;
+            cursor.run_match_times      = 0;
+        }
+        cursor.pending              = make_sympair_table(get_self()).get(sympair_id).is_crossed();
+        cursor.run_matched_count    += matched_count;
+        cursor.run_match_times      += 1;
+        cursor.last_deal_id         = _pair_seqs.last_deal_id(sympair_id);
+        cursor.last_matcher         = matcher;
+        cursor.updated_at           = current_time_point();
+    };
+    auto cursor_it = cursor_tbl.find(sympair_id);
+    if (cursor_it == cursor_tbl.end()) {
+        cursor_tbl.emplace(get_self(), [&](auto &cursor) {
+            cursor.sympair_id       = sympair_id;
+            cursor.pending          = false;
+            set_cursor(cursor);
+        });
+    } else {
+        cursor_tbl.modify(cursor_it, same_payer, set_cursor);
+    }
+}
+
+void dex_contract::prunedeals(const uint32_t& max_rows) {
+    CHECKC(max_rows > 0,                        err::PARAM_ERROR, "The max_rows must > 0")
+    auto retain_count   = get_config().deal_retain_count.value_or();
+    auto retain_secs    = get_config().deal_retain_secs.value_or();
+    CHECKC(retain_count > 0 || retain_secs > 0, err::STATUS_ERROR, "The deal retention is not set")
+
+    auto expired_time   = current_time_point() - seconds(retain_secs);
+    auto out_of_retention = [&](const uint64_t &deal_id, const time_point &deal_time, const uint64_t &last_deal_id) {
+        return (retain_count > 0 && deal_id + retain_count <= last_deal_id) || (retain_secs > 0 && deal_time < expired_time);
+    };
+
+    uint32_t pruned_count = 0;
+    // the legacy deals are sorted by the global deal id, the oldest first
+    legacy_deal_tbl legacy_deals(_self, _self.value);
+    auto legacy_it = legacy_deals.begin();
+    while (pruned_count < max_rows && legacy_it != legacy_deals.end()
+            && out_of_retention(legacy_it->id, legacy_it->deal_time, get_global().deal_item_id)) {
+        legacy_it = legacy_deals.erase(legacy_it);
+        pruned_count++;
+    }
+
+    deal_tbl deals(_self, _self.value);
+    deal_memo_tbl memos(_self, _self.value);
+    auto it = deals.begin();
+    while (pruned_count < max_rows && it != deals.end()) {
+        // the deals are sorted by pair, then the oldest first in pair
+        auto sympair_id     = get_pair_id(it->id);
+        auto last_deal_id   = _pair_seqs.last_deal_id(sympair_id);
+        auto pair_end_id    = make_pair_seq_id(sympair_id + 1, 0);
+        while (pruned_count < max_rows && it != deals.end() && it->id < pair_end_id) {
+            if (!out_of_retention(it->id, it->deal_time, last_deal_id)) break;
+            it = deals.erase(it);
+            pruned_count++;
+        }
+        // the memo is referred by the deals of pair from its id, keep the memo of the oldest deal left in pair
+        bool pair_left      = it != deals.end() && it->id < pair_end_id;
+        uint64_t memo_id_end = !pair_left ? pair_end_id :
+                               (it->memo_id > 0) ? std::min(it->id, it->memo_id) : it->id;
+        for (auto memo_it = memos.lower_bound(make_pair_seq_id(sympair_id, 0));
+                memo_it != memos.end() && memo_it->memo_id < memo_id_end; ) {
+            memo_it = memos.erase(memo_it);
+        }
+        if (pair_left) it = deals.lower_bound(pair_end_id);
+    }
+    CHECKC(pruned_count > 0,                    err::ACTION_REDUNDANT, "None pruned");
+}
+
+void dex_contract::migrateorder(const uint64_t& sympair_id, const uint32_t& max_rows) {
+    require_auth( get_config().dex_admin );
+    CHECKC(max_rows > 0,                        err::PARAM_ERROR, "The max_rows must > 0")
+
+    auto sympair_tbl = make_sympair_table(get_self());
+    auto sym_pair_it = sympair_tbl.find(sympair_id);
+    CHECKC( sym_pair_it != sympair_tbl.end(),   err::RECORD_NOT_FOUND, "sympair not found: " + to_string(sympair_id) )
+
+    uint32_t migrated_count = 0;
+    for (const auto &side : { order_side::BUY, order_side::SELL }) {
+        auto legacy_tbl = make_legacy_order_table(get_self(), sympair_id, side);
+        auto order_tbl = make_order_table(get_self(), sympair_id, side);
+        auto it = legacy_tbl.begin();
+        while (migrated_count < max_rows && it != legacy_tbl.end()) {
+            order_tbl.emplace(_self, [&](auto &row) {
+                row = packed_order_t::pack(it->to_order());
+            });
+            // the migrated order is counted in depth, its fill and cancel will take it out
+            update_depth(*sym_pair_it, side, it->price.amount,
+                         { (it->total_asset_quant - it->matched_asset_quant).amount, 1 });
+            it = legacy_tbl.erase(it);
+            migrated_count++;
+        }
+        refresh_best_price(sympair_id, side);
+    }
+    CHECKC(migrated_count > 0,                  err::ACTION_REDUNDANT, "None migrated");
 }
 
+/**
+ * match the crossed orders of sym_pair, or only the taker_order against the opposite side if it is set.
+ * the immediate taker_order is not in order book, its matched result is saved to it
+*/
 void dex_contract::match_sympair(const name &matcher, const dex::symbol_pair_t &sym_pair,
-                                  uint32_t max_count, uint32_t &matched_count, const string &memo) {
+                                  uint32_t max_count, uint32_t &matched_count, const string &memo,
+                                  dex::order_t *taker_order) {
     auto cur_block_time     = current_block_time();
-    auto matching_pair_it = dex::matching_pair_iterator( sym_pair,
-        dex::make_order_iterator(get_self(), sym_pair, dex::order_side::BUY),
-        dex::make_order_iterator(get_self(), sym_pair, dex::order_side::SELL)
-    );
+    auto buy_tbl            = make_order_table(get_self(), sym_pair.sympair_id, dex::order_side::BUY);
+    auto sell_tbl           = make_order_table(get_self(), sym_pair.sympair_id, dex::order_side::SELL);
+    auto make_side_iterator = [&](order_tbl &tbl, const order_side_t &side) {
+        if (!taker_order || taker_order->order_side != side)
+            return dex::make_order_iterator(tbl, sym_pair, side);
+        if (order_tif::is_immediate(taker_order->time_in_force))
+            return dex::make_transient_order_iterator(tbl, sym_pair, taker_order);
+        return dex::make_taker_order_iterator(tbl, sym_pair, *taker_order);
+    };
+    auto buy_order_it       = make_side_iterator(buy_tbl, dex::order_side::BUY);
+    auto sell_order_it      = make_side_iterator(sell_tbl, dex::order_side::SELL);
+    auto matching_pair_it   = dex::matching_pair_iterator( sym_pair, buy_order_it, sell_order_it );
     
     asset latest_deal_price;
-    std::list<deal_item_t> items;
+    std::vector<packed_deal_t> items;
+    deal_tbl deals(_self, _self.value);
+    uint64_t memo_id = 0;
+    depth_changes_t depth_changes;
+    settlements_t settlements;
+    reward_changes_t reward_changes;
     while (matched_count < max_count && matching_pair_it.can_match()) {
         TRACE_L("matched round begin count: " , matched_count);
 
@@ -284,36 +824,48 @@ void dex_contract::match_sympair(const name &matcher, const dex::symbol_pair_t &
         asset buyer_recv_assets = matched_asset_quant;
         const auto &asset_symbol = sym_pair.asset_symbol.get_symbol();
         const auto &coin_symbol = sym_pair.coin_symbol.get_symbol();
-        const auto &asset_bank  = sym_pair.asset_symbol.get_contract();
-        const auto &coin_bank   = sym_pair.coin_symbol.get_contract();
 
         asset buy_fee = calc_match_fee(buy_order, taker_it.order_side(), buyer_recv_assets);
         buyer_recv_assets -= buy_fee;
         // add_balance(_config.dex_fee_collector, asset_bank, buy_fee,  balance_type::orderfee,
         //             " order_id " + to_string(sell_order.order_id) + " deal with " + to_string(buy_order.order_id));
 
-        _allot_fee(buy_order.owner, asset_bank, buy_fee, sell_order.order_id);
+        _allot_fee(buy_order.owner, sym_pair.asset_symbol, buy_fee, reward_changes);
 
 
         auto sell_fee = calc_match_fee(sell_order, taker_it.order_side(), seller_recv_coins);
         seller_recv_coins -= sell_fee;
         // transfer the sell_fee from sell_order to dex_fee_collector
-        _allot_fee(sell_order.owner, coin_bank, sell_fee, sell_order.order_id);
+        _allot_fee(sell_order.owner, sym_pair.coin_symbol, sell_fee, reward_changes);
 
         // transfer the coins from buy_order to seller
-        add_balance(sell_order.owner, coin_bank, seller_recv_coins,  balance_type::ordermatched,
-                " order_id " + to_string(sell_order.order_id) + " deal with " + to_string(buy_order.order_id));
+        settlements[{sell_order.owner, sym_pair.coin_symbol}] += seller_recv_coins.amount;
 
         // transfer the assets from sell_order  to buyer
-        add_balance(buy_order.owner, asset_bank, buyer_recv_assets,  balance_type::ordermatched,
-                " order_id " + to_string(buy_order.order_id) + " deal with " + to_string(sell_order.order_id));
+        settlements[{buy_order.owner, sym_pair.asset_symbol}] += buyer_recv_assets.amount;
 
-        auto deal_id = _global->new_deal_item_id();
+        auto deal_id = _pair_seqs.new_deal_id(sym_pair.sympair_id);
 
         buy_it.match(deal_id, matched_asset_quant, matched_coin_quant, buy_fee);
         sell_it.match(deal_id, matched_asset_quant, matched_coin_quant, sell_fee);
 
-        CHECKC(buy_it.is_completed() || sell_it.is_completed(), err::STATUS_ERROR, "Neither buy_order nor sell_order is completed");
+        // the fill of market buy order is limited by its budget, which may still buy more after the rounded spend,
+        // so the same orders are matched again until can_match() finds the budget exhausted
+        bool budget_limited = taker_it.is_market() && taker_it.order_side() == order_side::BUY;
+        CHECKC(buy_it.is_completed() || sell_it.is_completed() || budget_limited, err::STATUS_ERROR,
+               "Neither buy_order nor sell_order is completed");
+
+        // the transient order is not counted in depth
+        if (!buy_it.is_transient()) {
+            auto &buy_depth = depth_changes[{order_side::BUY, buy_order.price.amount}];
+            buy_depth.quantity -= matched_asset_quant.amount;
+            if (buy_it.is_completed()) buy_depth.order_count--;
+        }
+        if (!sell_it.is_transient()) {
+            auto &sell_depth = depth_changes[{order_side::SELL, sell_order.price.amount}];
+            sell_depth.quantity -= matched_asset_quant.amount;
+            if (sell_it.is_completed()) sell_depth.order_count--;
+        }
 
         // process refund
         asset buy_refund_coin_quant(0, coin_symbol);
@@ -322,30 +874,38 @@ void dex_contract::match_sympair(const name &matcher, const dex::symbol_pair_t &
             buy_refund_coin_quant = buy_it.get_refund_coins();
             if (buy_refund_coin_quant.amount > 0) {
                 // refund from buy_order to buyer
-                add_balance(buy_order.owner, coin_bank, buy_refund_coin_quant,
-                    balance_type::orderrefund, " order_id: " + to_string(buy_order.order_id));
+                settlements[{buy_order.owner, sym_pair.coin_symbol}] += buy_refund_coin_quant.amount;
             }
         }
 
-        deal_item_t deal_item;
+        if (memo_id == 0 && !memo.empty()) {
+            // the memo is saved once for all deals of this match
+            memo_id = deal_id;
+            deal_memo_tbl memos(_self, _self.value);
+            memos.emplace(_self, [&](auto& row) {
+                row.memo_id = memo_id;
+                row.memo    = memo;
+            });
+        }
+
+        packed_deal_t deal_item;
         deal_item.id            = deal_id;
-        deal_item.sympair_id    = sym_pair.sympair_id;        
+        deal_item.sympair_id    = sym_pair.sympair_id;
         deal_item.buy_order_id  = buy_order.order_id;
         deal_item.sell_order_id = sell_order.order_id;
         deal_item.buyer         = buy_order.owner;
         deal_item.seller        = sell_order.owner;
-        deal_item.deal_asset_quant   = matched_asset_quant;
-        deal_item.deal_coin_quant    = matched_coin_quant;
-        deal_item.deal_price    = matched_price;
-        deal_item.taker_side    = taker_it.order_side();
-        deal_item.buy_fee       = buy_fee;
-        deal_item.sell_fee      = sell_fee;
-        deal_item.buy_refund_coin_quant = buy_refund_coin_quant;
-        deal_item.memo          = memo;
+        deal_item.deal_asset_amount  = matched_asset_quant.amount;
+        deal_item.deal_coin_amount   = matched_coin_quant.amount;
+        deal_item.deal_price    = matched_price.amount;
+        deal_item.taker_side    = order_side::index(taker_it.order_side());
+        deal_item.buy_fee       = buy_fee.amount;
+        deal_item.sell_fee      = sell_fee.amount;
+        deal_item.buy_refund_coin_amount = buy_refund_coin_quant.amount;
+        deal_item.memo_id       = memo_id;
         deal_item.deal_time     = cur_block_time;
         items.push_back(deal_item);
-        
-        deal_tbl deals(_self, _self.value);
+
         deals.emplace(_self, [&](auto& row) {
             row = deal_item;
         });
@@ -358,79 +918,221 @@ void dex_contract::match_sympair(const name &matcher, const dex::symbol_pair_t &
 
     TRACE_L("match finished: " , matched_count);
 
-    ADD_DEAL_ACTION( items, time_point_sec(current_time_point()) );
+    ADD_DEAL_ACTION( items, memo, time_point_sec(current_time_point()) );
 
     TRACE_L("save matching order begin");
     matching_pair_it.save_matching_order();
     TRACE_L("save matching order end");
 
-    if (latest_deal_price.amount > 0)
-        update_latest_deal_price(sym_pair.sympair_id, latest_deal_price);
+    // the unmatched funds of immediate order are refunded with the settlements
+    if (taker_order && order_tif::is_immediate(taker_order->time_in_force)
+            && taker_order->matched_asset_quant < taker_order->total_asset_quant) {
+        if (taker_order->order_side == order_side::BUY) {
+            settlements[{taker_order->owner, sym_pair.coin_symbol}] +=
+                (taker_order->total_frozen_quant - taker_order->matched_coin_quant).amount;
+        } else {
+            settlements[{taker_order->owner, sym_pair.asset_symbol}] +=
+                (taker_order->total_asset_quant - taker_order->matched_asset_quant).amount;
+        }
+    }
+
+    for (const auto &change : depth_changes) {
+        update_depth(sym_pair, change.first.first, change.first.second, change.second);
+    }
+
+    // one transfer per (user, token) for all deals of this round
+    auto settle_memo = "deals: " + to_string(matched_count) + " " + memo;
+    for (const auto &settlement : settlements) {
+        if (settlement.second <= 0) continue;
+        const auto &ext_sym = settlement.first.second;
+        add_balance(settlement.first.first, ext_sym.get_contract(), asset(settlement.second, ext_sym.get_symbol()),
+                    balance_type::ordermatched, settle_memo);
+    }
+
+    // one rewards row write per user for all fees of this round
+    add_rewards(reward_changes);
+    for (const auto &change : reward_changes) {
+        const auto &ext_sym = std::get<2>(change.first);
+        log_balance(std::get<0>(change.first), ext_sym.get_contract(), asset(change.second, ext_sym.get_symbol()),
+                    std::get<1>(change.first), settle_memo);
+    }
+
+    const auto &coin_symbol = sym_pair.coin_symbol.get_symbol();
+    update_sympair_prices(sym_pair.sympair_id,
+                          buy_order_it.best_price(coin_symbol),
+                          sell_order_it.best_price(coin_symbol),
+                          latest_deal_price);
 }
 
 
-void dex_contract::adddexdeal(const std::list<dex::deal_item_t>& deal_items, const time_point_sec& curr_ts ) {
+void dex_contract::adddexdeal(const std::vector<dex::packed_deal_t>& deal_items, const string& memo,
+                              const time_point_sec& curr_ts ) {
     require_auth(get_self());
     require_recipient(get_self());
 }
 
-void dex_contract::orderchange( const uint64_t order_id, const dex::order_t& order) {
+void dex_contract::orderchange( const dex::order_event_t& order_event ) {
     require_auth(get_self());
     require_recipient(get_self());
 }
 
-void dex_contract::_allot_fee(const name &from_user, const name& bank, const asset& fee, const uint64_t order_id){
+void dex_contract::balancechg( const dex::balance_chg_t& change) {
+    require_auth(get_self());
+    require_recipient(get_self());
+}
+
+void dex_contract::_allot_fee(const name &from_user, const extended_symbol& fee_symbol, const asset& fee,
+                              dex::reward_changes_t &reward_changes) {
     if(fee.amount <= 0) return;
     auto dex_fee = fee;
 
-    if(_config.parent_reward_ratio >0){
-        auto parent = get_account_creator(from_user);
+    if(get_config().parent_reward_ratio >0){
+        const auto &referral = get_referral(from_user);
+        const auto &parent = referral.parent;
         if(parent != SYS_ACCOUNT) {
-            auto parent_reward = fee * _config.parent_reward_ratio / RATIO_PRECISION;
+            auto parent_reward = fee * get_config().parent_reward_ratio / RATIO_PRECISION;
             if(parent_reward.amount > 0){
                 dex_fee -= parent_reward;
-                add_balance(parent, bank, parent_reward, balance_type::parentreward,
-                    "parent reward from: " + from_user.to_string() + " order: " + to_string(order_id));
+                reward_changes[{parent, balance_type::parentreward, fee_symbol}] += parent_reward.amount;
             }
 
-            if(_config.grand_reward_ratio >0){
-                auto grand = get_account_creator(parent);
-                auto grand_reward = fee * _config.grand_reward_ratio / RATIO_PRECISION;
+            if(get_config().grand_reward_ratio >0){
+                const auto &grand = referral.grand;
+                auto grand_reward = fee * get_config().grand_reward_ratio / RATIO_PRECISION;
                 if(grand_reward.amount > 0) {
                     dex_fee -= grand_reward;
-                    add_balance(grand, bank, grand_reward, balance_type::grandreward,
-                        "grand reward from: " + from_user.to_string() + " order: " + to_string(order_id));
+                    reward_changes[{grand, balance_type::grandreward, fee_symbol}] += grand_reward.amount;
                 }
             }
         }
     }
 
     if(dex_fee.amount > 0){
-        add_balance(_config.dex_fee_collector, bank, dex_fee, balance_type::orderfee, "fee: " + to_string(order_id));
+        reward_changes[{get_config().dex_fee_collector, balance_type::orderfee, fee_symbol}] += dex_fee.amount;
+    }
+}
+
+const dex::referral_t& dex_contract::get_referral(const name &user) {
+    auto cached = _referrals.find(user);
+    if (cached != _referrals.end()) return cached->second;
+
+    auto referral_tbl = make_referral_table(get_self());
+    auto it = referral_tbl.find(user.value);
+    if (it != referral_tbl.end()) {
+        return _referrals.emplace(user, *it).first->second;
+    }
+
+    referral_t referral;
+    referral.owner      = user;
+    referral.parent     = get_account_creator(user);
+    referral.grand      = (referral.parent != SYS_ACCOUNT) ? get_account_creator(referral.parent) : SYS_ACCOUNT;
+    referral_tbl.emplace(get_self(), [&](auto &row) {
+        row = referral;
+    });
+    return _referrals.emplace(user, referral).first->second;
+}
+
+void dex_contract::delreferral(const vector<name>& users) {
+    require_auth( get_config().dex_admin );
+
+    auto referral_tbl = make_referral_table(get_self());
+    for (const auto &user : users) {
+        auto it = referral_tbl.find(user.value);
+        CHECKC( it != referral_tbl.end(), err::RECORD_NOT_FOUND, "The referral of user=" + user.to_string() + " does not exist")
+        referral_tbl.erase(it);
+        _referrals.erase(user);
+    }
+}
+
+void dex_contract::update_depth(const dex::symbol_pair_t &sym_pair, const name &side, const int64_t &price,
+                                const dex::depth_delta_t &delta) {
+    if (delta.quantity == 0 && delta.order_count == 0) return;
+
+    auto depth_tbl = make_depth_table(get_self(), sym_pair.sympair_id, side);
+    auto it = depth_tbl.find(price);
+    if (it == depth_tbl.end()) {
+        // the orders placed before the depth table existed are not counted
+        if (delta.quantity <= 0 && delta.order_count <= 0) return;
+        depth_tbl.emplace(get_self(), [&](auto &row) {
+            row.price           = asset(price, sym_pair.coin_symbol.get_symbol());
+            row.quantity        = asset(delta.quantity, sym_pair.asset_symbol.get_symbol());
+            row.order_count     = delta.order_count;
+        });
+        return;
+    }
+
+    if (int64_t(it->order_count) + delta.order_count <= 0 || it->quantity.amount + delta.quantity <= 0) {
+        depth_tbl.erase(it);
+        return;
     }
+    depth_tbl.modify(*it, same_payer, [&](auto &row) {
+        row.quantity.amount += delta.quantity;
+        row.order_count     += delta.order_count;
+    });
 }
 
-void dex_contract::update_latest_deal_price(const uint64_t& sympair_id, const asset& latest_deal_price) {
+/**
+ * save the top of book prices, and the latest deal price if it is positive
+*/
+void dex_contract::update_sympair_prices(const uint64_t& sympair_id, const asset& best_bid_price,
+                                         const asset& best_ask_price, const asset& latest_deal_price) {
 
-    TRACE_L("update_latest_deal_price begin");
+    TRACE_L("update_sympair_prices begin");
 
     auto sympair_tbl = make_sympair_table(_self);
     auto it = sympair_tbl.find( sympair_id );
     CHECKC( it != sympair_tbl.end(), err::PARAM_ERROR, "Err: sympair not found" )
 
+    if (it->get_best_bid_price().amount == best_bid_price.amount && it->get_best_ask_price().amount == best_ask_price.amount
+            && latest_deal_price.amount <= 0) {
+        return;
+    }
     sympair_tbl.modify(*it, same_payer, [&](auto &row) {
-        row.latest_deal_price = latest_deal_price;
+        row.best_bid_price = best_bid_price;
+        row.best_ask_price = best_ask_price;
+        if (latest_deal_price.amount > 0)
+            row.latest_deal_price = latest_deal_price;
     });
-    TRACE_L("update_latest_deal_price end");
+    TRACE_L("update_sympair_prices end");
 }
 
 void dex_contract::neworder(const name &user, const uint64_t &sympair_id,
                             const name &order_side, const asset &total_asset_quant,
                             const asset &price,
                             const uint64_t &ext_id,
-                            const optional<dex::order_config_ex_t> &order_config_ex) {
+                            const optional<dex::order_config_ex_t> &order_config_ex,
+                            const binary_extension<name> &time_in_force) {
     // total_frozen_quant not in use
-    new_order(user, sympair_id, order_side, total_asset_quant, price, ext_id, order_config_ex);
+    new_order(user, sympair_id, order_side, total_asset_quant, price, ext_id, order_config_ex,
+              time_in_force.has_value() ? time_in_force.value() : order_tif::GTC);
+}
+
+void dex_contract::neworders(const name &user, const vector<dex::order_param_t> &orders) {
+    CHECK_DEX_ENABLED()
+    CHECKC(is_account(user), err::ACCOUNT_INVALID, "Account of user=" + user.to_string() + " does not existed");
+    require_auth(user);
+    if (get_config().admin_sign_required) { require_auth(get_config().dex_admin); }
+    CHECKC( !orders.empty(),                            err::PARAM_ERROR, "The orders can not be empty")
+    CHECKC( orders.size() <= DEX_BATCH_ORDERS_MAX,      err::OVERSIZED, "The orders size must <= " + std::to_string(DEX_BATCH_ORDERS_MAX))
+
+    auto queue_tbl      = make_queue_table(get_self());
+    check_queue_size(queue_tbl, user, orders.size());
+
+    // the sympair rows are read once and shared by the whole batch
+    auto sympair_tbl = make_sympair_table(get_self());
+    std::map<uint64_t, symbol_pair_t> sym_pairs;
+    for (const auto &param : orders) {
+        auto pair_it = sym_pairs.find(param.sympair_id);
+        if (pair_it == sym_pairs.end()) {
+            auto sym_pair_it = sympair_tbl.find(param.sympair_id);
+            CHECKC( sym_pair_it != sympair_tbl.end(),   err::PARAM_ERROR, "The symbol pair id '" + std::to_string(param.sympair_id) + "' does not exist")
+            CHECKC( sym_pair_it->enabled,               err::STATUS_ERROR, "The symbol pair [" + std::to_string(param.sympair_id) + "] is disabled")
+            pair_it = sym_pairs.emplace(param.sympair_id, *sym_pair_it).first;
+        }
+
+        queue_order(queue_tbl, user, pair_it->second, param.order_side, param.total_asset_quant, param.price,
+                    param.ext_id, get_config().taker_fee_ratio, get_config().maker_fee_ratio, param.time_in_force);
+    }
 }
 
 /**
@@ -440,22 +1142,20 @@ void dex_contract::new_order(const name &user, const uint64_t &sympair_id,
                              const name &order_side, const asset &total_asset_quant,
                              const optional<asset> &price,
                              const uint64_t &ext_id,
-                             const optional<dex::order_config_ex_t> &order_config_ex) {
+                             const optional<dex::order_config_ex_t> &order_config_ex,
+                             const name &time_in_force) {
     CHECK_DEX_ENABLED()
     CHECKC(is_account(user), err::ACCOUNT_INVALID, "Account of user=" + user.to_string() + " does not existed");
     require_auth(user);
-    if (_config.admin_sign_required || order_config_ex) { require_auth(_config.dex_admin); }
+    if (get_config().admin_sign_required || order_config_ex) { require_auth(get_config().dex_admin); }
 
     auto sympair_tbl = make_sympair_table(get_self());
     auto sym_pair_it = sympair_tbl.find(sympair_id);
     CHECKC( sym_pair_it != sympair_tbl.end(),   err::PARAM_ERROR, "The symbol pair id '" + std::to_string(sympair_id) + "' does not exist")
     CHECKC( sym_pair_it->enabled,               err::STATUS_ERROR, "The symbol pair [" + std::to_string(sympair_id) + "] is disabled")
 
-    const auto &asset_symbol    = sym_pair_it->asset_symbol.get_symbol();
-    const auto &coin_symbol     = sym_pair_it->coin_symbol.get_symbol();
-
-    auto taker_fee_ratio = _config.taker_fee_ratio;
-    auto maker_fee_ratio = _config.maker_fee_ratio;
+    auto taker_fee_ratio = get_config().taker_fee_ratio;
+    auto maker_fee_ratio = get_config().maker_fee_ratio;
     if (order_config_ex) {
         taker_fee_ratio = order_config_ex->taker_fee_ratio;
         maker_fee_ratio = order_config_ex->maker_fee_ratio;
@@ -463,6 +1163,60 @@ void dex_contract::new_order(const name &user, const uint64_t &sympair_id,
         validate_fee_ratio(maker_fee_ratio, "ratio");
     }
 
+    auto queue_tbl      = make_queue_table(get_self());
+    check_queue_size(queue_tbl, user, 1);
+
+    queue_order(queue_tbl, user, *sym_pair_it, order_side, total_asset_quant, price, ext_id, taker_fee_ratio, maker_fee_ratio,
+                time_in_force);
+}
+
+void dex_contract::check_queue_size(const dex::queue_tbl &queue_tbl, const name &user, uint32_t new_count) {
+    auto queue_owner_idx = queue_tbl.get_index<"ownerorder"_n>();
+    uint32_t count = new_count;
+    auto itr = queue_owner_idx.lower_bound(make_uint128(user.value, 0));
+    for (; itr != queue_owner_idx.end() && itr->owner == user && count <= DEX_QUEUE_ORDERS_MAX; itr++) {
+        count++;
+    }
+    CHECKC( count <= DEX_QUEUE_ORDERS_MAX, err::OVERSIZED,
+        "The queued orders of user=" + user.to_string() + " exceed " + std::to_string(DEX_QUEUE_ORDERS_MAX));
+}
+
+void dex_contract::queue_order(dex::queue_tbl &queue_tbl, const name &user,
+                             const dex::symbol_pair_t &sym_pair,
+                             const name &order_side, const asset &total_asset_quant,
+                             const optional<asset> &price,
+                             const uint64_t &ext_id,
+                             const int64_t &taker_fee_ratio,
+                             const int64_t &maker_fee_ratio,
+                             const name &time_in_force) {
+    auto order = make_order(user, sym_pair, order_side, total_asset_quant, price, ext_id, taker_fee_ratio, maker_fee_ratio,
+                            time_in_force);
+    order.order_id = get_global().new_queue_order_id();
+    // the user is authorized by the callers, so the user pays for the queued rows of own
+    queue_tbl.emplace(user, [&](auto &row) {
+        row = order;
+    });
+}
+
+dex::order_t dex_contract::make_order(const name &user,
+                             const dex::symbol_pair_t &sym_pair,
+                             const name &order_side, const asset &total_asset_quant,
+                             const optional<asset> &price,
+                             const uint64_t &ext_id,
+                             const int64_t &taker_fee_ratio,
+                             const int64_t &maker_fee_ratio,
+                             const name &time_in_force) {
+    const auto &asset_symbol    = sym_pair.asset_symbol.get_symbol();
+    const auto &coin_symbol     = sym_pair.coin_symbol.get_symbol();
+    auto tif = time_in_force.value == 0 ? order_tif::GTC : time_in_force;
+    CHECKC( order_tif::is_valid(tif), err::PARAM_ERROR, "Invalid time_in_force=" + tif.to_string())
+    if (!price) {
+        // the market order never rests in order book
+        CHECKC( tif == order_tif::GTC || tif == order_tif::IOC, err::PARAM_ERROR,
+            "Invalid time_in_force=" + tif.to_string() + " for market order")
+        tif = order_tif::IOC;
+    }
+
     // check price
     if (price) {
         CHECKC(price->symbol == coin_symbol, err::PARAM_ERROR, "The price symbol mismatch with coin_symbol")
@@ -470,12 +1224,21 @@ void dex_contract::new_order(const name &user, const uint64_t &sympair_id,
     }
 
     asset total_frozen_quant;
-    if (order_side == dex::order_side::BUY) {
+    auto order_asset_quant = total_asset_quant;
+    if (order_side == dex::order_side::BUY && !price) {
+        // market buy order: total_asset_quant is the coin budget, the assets to buy are limited by the budget only
+        CHECKC( total_asset_quant.symbol == coin_symbol, err::PARAM_ERROR,
+            "The budget_symbol=" + symbol_to_string(total_asset_quant.symbol) +
+            " mismatch with coin_symbol=" + symbol_to_string(coin_symbol) +
+            " for market buy order");
+        total_frozen_quant = total_asset_quant;
+        order_asset_quant = asset(asset::max_amount, asset_symbol);
+
+    } else if (order_side == dex::order_side::BUY) {
         CHECKC( total_asset_quant.symbol == asset_symbol, err::PARAM_ERROR,
             "The limit_symbol=" + symbol_to_string(total_asset_quant.symbol) +
             " mismatch with asset_symbol=" + symbol_to_string(asset_symbol) +
             " for limit buy order");
-        ASSERT(price.has_value());
         total_frozen_quant = dex::calc_coin_quant(total_asset_quant, *price, coin_symbol);
 
     } else { // order_side == order_side::SELL
@@ -488,49 +1251,67 @@ void dex_contract::new_order(const name &user, const uint64_t &sympair_id,
 
     const auto &fee_symbol = (order_side == dex::order_side::BUY) ? asset_symbol : coin_symbol;
 
-    auto queue_tbl      = make_queue_table(get_self());
-    auto acct_idx       = queue_tbl.get_index<"orderowner"_n>();
-
-    CHECKC( acct_idx.find(user.value) == acct_idx.end(), err::PARAM_ERROR, "The user exists: user=" + user.to_string());
-
     auto cur_block_time = current_block_time();
-    auto order_id       = _global->new_queue_order_id();
-    queue_tbl.emplace(get_self(), [&](auto &order) {
-        order.order_id          = order_id;
-        order.ext_id            = ext_id;
-        order.owner             = user;
-        order.sympair_id        = sympair_id;
-        order.order_side        = order_side;
-        order.order_type        = order_type::LIMIT;
-        order.price             = price ? *price : asset(0, coin_symbol);
-        order.total_asset_quant       = total_asset_quant;
-        order.total_frozen_quant      = total_frozen_quant;
-        order.taker_fee_ratio   = taker_fee_ratio;
-        order.maker_fee_ratio   = maker_fee_ratio;
-        order.matched_asset_quant    = asset(0, asset_symbol);
-        order.matched_coin_quant     = asset(0, coin_symbol);
-        order.matched_fee       = asset(0, fee_symbol);
-        order.created_at        = cur_block_time;
-        order.last_updated_at   = cur_block_time;
-        order.last_deal_id      = 0;
-    });
+    dex::order_t order;
+    order.order_id          = 0;
+    order.ext_id            = ext_id;
+    order.owner             = user;
+    order.sympair_id        = sym_pair.sympair_id;
+    order.order_side        = order_side;
+    order.order_type        = price ? order_type::LIMIT : order_type::MARKET;
+    order.price             = price ? *price : asset(0, coin_symbol);
+    order.total_asset_quant       = order_asset_quant;
+    order.total_frozen_quant      = total_frozen_quant;
+    order.taker_fee_ratio   = taker_fee_ratio;
+    order.maker_fee_ratio   = maker_fee_ratio;
+    order.matched_asset_quant    = asset(0, asset_symbol);
+    order.matched_coin_quant     = asset(0, coin_symbol);
+    order.matched_fee       = asset(0, fee_symbol);
+    order.created_at        = cur_block_time;
+    order.last_updated_at   = cur_block_time;
+    order.last_deal_id      = 0;
+    order.time_in_force     = tif;
+    return order;
 }
 
-void dex_contract::add_balance(const name &user, const name &bank, const asset &quantity, const name &type, const string& memo){
+void dex_contract::log_balance(const name &user, const name &bank, const asset &quantity, const name &type, const string& memo){
+
+    balance_chg_t change;
+    change.user            = user;
+    change.bank            = bank;
+    change.quantity        = quantity;
+    change.type            = type;
+    change.memo            = memo;
+    TRACE_L("add_balance =", change);
+
+    if (get_config().balance_log_mode.value_or() == balance_log_mode::NOTIFY) {
+        BALANCECHG_ACTION( change );
+        return;
+    }
 
     balance_chg_tbl balances(_self, _self.value);
-    auto balance_id = balances.available_primary_key();
+    if (get_config().balance_log_mode.value_or() == balance_log_mode::RING) {
+        // overwrite the oldest change in the ring
+        change.balance_id = new_balance_log_id() % get_config().balance_log_size.value_or();
+        auto it = balances.find(change.balance_id);
+        if (it != balances.end()) {
+            balances.modify(*it, _self, [&]( auto& row) {
+                row = change;
+            });
+            return;
+        }
+    } else {
+        change.balance_id = balances.available_primary_key();
+    }
 
     balances.emplace(_self, [&]( auto& row) {
-        row.balance_id      = balance_id;
-        row.user            = user;
-        row.bank            = bank;
-        row.quantity        = quantity;
-        row.type            = type;
-        row.memo            = memo;
-        TRACE_L("add_balance =", row);
-
+        row = change;
     });
+}
+
+void dex_contract::add_balance(const name &user, const name &bank, const asset &quantity, const name &type, const string& memo){
+
+    log_balance(user, bank, quantity, type, memo);
 
     switch (type.value)
     {
@@ -542,52 +1323,104 @@ void dex_contract::add_balance(const name &user, const name &bank, const asset &
     case balance_type::orderfee.value:
     case balance_type::parentreward.value:
     case balance_type::grandreward.value:
-    {
-        auto rewards = make_reward_table(get_self());
-        auto it = rewards.find( user.value );
-
-        extended_asset reward_asset = extended_asset(quantity, bank);
-        extended_symbol reward_symbol = reward_asset.get_extended_symbol();
-        if (it != rewards.end()) {
-            rewards.modify(*it, _self, [&](auto &row) {
-                if(row.rewards.count(reward_symbol) == 0){
-                    row.rewards[reward_symbol] = 0;
-                }
-                row.rewards[reward_symbol] += quantity.amount;
-            });
-        } else {
-            rewards.emplace(_self, [&]( auto& row ) {
-                row.owner                   = user;
-                row.rewards[reward_symbol]  = quantity.amount;
-            });
-        }
+        add_rewards({ {{user, type, extended_symbol(quantity.symbol, bank)}, quantity.amount} });
         break;
-    }
     default:
         break;
     }
 }
 
+/**
+ * the same (user, token) rewards of different types are summed, so each rewards row is written once
+*/
+void dex_contract::add_rewards(const dex::reward_changes_t &changes) {
+    std::map<std::pair<name, extended_symbol>, int64_t> amounts;
+    for (const auto &change : changes) {
+        amounts[{std::get<0>(change.first), std::get<2>(change.first)}] += change.second;
+    }
+    auto rewards = make_reward_table(get_self());
+    for (const auto &item : amounts) {
+        add_reward(rewards, item.first.first, item.first.second, item.second);
+    }
+}
+
+void dex_contract::add_reward(dex::rewards_tbl &rewards, const name &user, const extended_symbol &ext_symbol,
+                              const int64_t &amount) {
+    if (amount == 0) return;
+    auto reward_idx = rewards.get_index<"ownersym"_n>();
+    auto reward_it = find_reward(reward_idx, user, ext_symbol);
+    if (reward_it != reward_idx.end()) {
+        reward_idx.modify(reward_it, same_payer, [&]( auto& row ) {
+            row.amount              += amount;
+        });
+    } else {
+        rewards.emplace(_self, [&]( auto& row ) {
+            row.id                  = rewards.available_primary_key();
+            row.owner               = user;
+            row.ext_symbol          = ext_symbol;
+            row.amount              = amount;
+        });
+    }
+}
+
+void dex_contract::migratequeue(const uint32_t& max_rows) {
+    require_auth( get_config().dex_admin );
+    CHECKC(max_rows > 0,                        err::PARAM_ERROR, "The max_rows must > 0")
+
+    auto legacy_tbl = make_legacy_queue_table(get_self());
+    auto legacy_owner_idx = legacy_tbl.get_index<"orderowner"_n>();
+    auto queue_tbl = make_queue_table(get_self());
+    uint32_t migrated_count = 0;
+    auto it = legacy_owner_idx.begin();
+    while (migrated_count < max_rows && it != legacy_owner_idx.end()) {
+        auto order = it->to_order();
+        it = legacy_owner_idx.erase(it);
+        queue_tbl.emplace(_self, [&](auto &row) {
+            row = order;
+        });
+        migrated_count++;
+    }
+    CHECKC(migrated_count > 0,                  err::ACTION_REDUNDANT, "None migrated");
+}
+
+void dex_contract::migreward(const uint32_t& max_rows) {
+    require_auth( get_config().dex_admin );
+    CHECKC(max_rows > 0,                        err::PARAM_ERROR, "The max_rows must > 0")
+
+    auto legacy_tbl = make_legacy_reward_table(get_self());
+    auto rewards = make_reward_table(get_self());
+    uint32_t migrated_count = 0;
+    auto it = legacy_tbl.begin();
+    while (migrated_count < max_rows && it != legacy_tbl.end()) {
+        for (const auto &reward : it->rewards) {
+            add_reward(rewards, it->owner, reward.first, reward.second);
+        }
+        it = legacy_tbl.erase(it);
+        migrated_count++;
+    }
+    CHECKC(migrated_count > 0,                  err::ACTION_REDUNDANT, "None migrated");
+}
+
 void dex_contract::withdraw(const name &user, const name &bank, const asset& quant, const string &memo) {
     CHECK_DEX_ENABLED()
     require_auth(user);
     CHECKC(quant.amount > 0, err::PARAM_ERROR, "quantity must be positive");
 
-    auto reward_tbl = make_reward_table(get_self());
-    auto it = reward_tbl.find(user.value);
-
-    CHECKC(it != reward_tbl.end(),err::RECORD_NOT_FOUND, "The user does not exist or has reward")
-
     extended_symbol ext_symbol = extended_symbol(quant.symbol, bank);
-
-    CHECKC( it->rewards.count(ext_symbol),              err::STATUS_ERROR, "mismatched symbol of reward" )
-    CHECKC( it->rewards.at(ext_symbol) >= quant.amount, err::PARAM_ERROR, "overdrawn balance" )
-    reward_tbl.modify(*it, _self, [&](auto &row) {
-        row.rewards[ext_symbol] -= quant.amount;
-        if(row.rewards[ext_symbol] == 0){
-            row.rewards.erase(ext_symbol);
-        }
-    });
+    auto reward_tbl = make_reward_table(get_self());
+    auto reward_idx = reward_tbl.get_index<"ownersym"_n>();
+    auto it = find_reward(reward_idx, user, ext_symbol);
+
+    CHECKC( it != reward_idx.end(), err::RECORD_NOT_FOUND,
+        "The user has no reward of " + quant.symbol.code().to_string() + "@" + bank.to_string() )
+    CHECKC( it->amount >= quant.amount, err::PARAM_ERROR, "overdrawn balance" )
+    if (it->amount == quant.amount) {
+        reward_idx.erase(it);
+    } else {
+        reward_idx.modify(it, same_payer, [&](auto &row) {
+            row.amount -= quant.amount;
+        });
+    }
 
     TRANSFER( bank, user, quant, "reward withdraw" )
 }
@@ -596,22 +1429,33 @@ void dex_contract::buy(const name &user, const uint64_t &sympair_id, const asset
                             const asset &price, const uint64_t &ext_id) {
     optional<dex::order_config_ex_t> order_config_ex;
     new_order(user, sympair_id, order_side::BUY, quantity, price,
-              ext_id, order_config_ex);
+              ext_id, order_config_ex, order_tif::GTC);
 }
 
 void dex_contract::sell(const name &user, const uint64_t &sympair_id, const asset &quantity,
                              const asset &price, const uint64_t &ext_id) {
     optional<dex::order_config_ex_t> order_config_ex;
     new_order(user, sympair_id, order_side::SELL, quantity, price,
-              ext_id, order_config_ex);
+              ext_id, order_config_ex, order_tif::GTC);
 }
 
-void dex_contract::delqueueord(const name& user) {
+void dex_contract::delqueueord(const name& user, const uint64_t& queue_order_id) {
     require_auth(user);
 
     auto queue_tbl = make_queue_table(get_self());
-    auto queue_owner_idx = queue_tbl.get_index<"orderowner"_n>();
-    auto order_itr = queue_owner_idx.find(user.value);
-    CHECKC( order_itr != queue_owner_idx.end(), err::PARAM_ERROR, "The order not in queue: user=" + user.to_string());
-    queue_owner_idx.erase(order_itr);
-}
\ No newline at end of file
+    auto queue_owner_idx = queue_tbl.get_index<"ownerorder"_n>();
+    if (queue_order_id != 0) {
+        auto order_itr = queue_owner_idx.find(make_uint128(user.value, queue_order_id));
+        CHECKC( order_itr != queue_owner_idx.end(), err::PARAM_ERROR,
+            "The order not in queue: user=" + user.to_string() + ", queue_order_id=" + std::to_string(queue_order_id));
+        queue_owner_idx.erase(order_itr);
+        return;
+    }
+
+    auto order_itr = queue_owner_idx.lower_bound(make_uint128(user.value, 0));
+    CHECKC( order_itr != queue_owner_idx.end() && order_itr->owner == user, err::PARAM_ERROR,
+        "The order not in queue: user=" + user.to_string());
+    while (order_itr != queue_owner_idx.end() && order_itr->owner == user) {
+        order_itr = queue_owner_idx.erase(order_itr);
+    }
+}
@@ -1,12 +1,21 @@
+import os
 import time
 import unittest
 from amaxfactory.eosf import *
 
 verbosity([Verbosity.INFO, Verbosity.OUT, Verbosity.TRACE, Verbosity.DEBUG])
 
-CONTRACT_WASM_PATH = "/Users/joslin/code/workspace/amaxfactory/templates/wasm/"
+# the paths are set by env, the defaults are this checkout and the amaxfactory home of user
+DEX_PATH = os.environ.get("DEX_PATH", os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
 
-CUSTOMER_WASM_PATH = "/Users/joslin/code/workspace/opensource/dex.contracts"
+CONTRACT_WASM_PATH = os.environ.get("AMAXFACTORY_WASM_PATH", os.path.expanduser("~/amaxfactory/templates/wasm/"))
+
+CUSTOMER_WASM_PATH = DEX_PATH
+
+DEX_TEST_LOG = os.environ.get("DEX_TEST_LOG", os.path.expanduser("~/amaxfactory/log/dex.log"))
+
+# the checkout of the deployed dex release, the migration scenario is skipped if not set
+DEX_LEGACY_PATH = os.environ.get("DEX_LEGACY_PATH", "")
 
 MASTER = MasterAccount()
 HOST = Account()
@@ -18,7 +27,7 @@ class Test(unittest.TestCase):
         SCENARIO('''
         Create a contract from template, then build and deploy it.
         ''')
-        reset("/Users/joslin/amaxfactory/log/dex.log")
+        reset(DEX_TEST_LOG)
     
     
     @classmethod
@@ -33,7 +42,7 @@ class Test(unittest.TestCase):
         '''
         
         
-        dex_path = "/Users/joslin/code/workspace/opensource/dex.contracts"
+        dex_path = DEX_PATH
         init.build(dex_path)
         dex = init.ORDERBOOKDEX()
         dex.init(dex)
@@ -69,6 +78,8 @@ class Test(unittest.TestCase):
         buyer = self.init_buyer_account(buyerp1, admin, amax_token, amax_mtoken, "buyer")
         
         seller = self.init_seller_account(sellerp1, admin, amax_token, amax_mtoken, "seller")
+
+        self.migrate_legacy_orders(dex, dex_path, dexadmin, buyer, seller)
         # u3 = self.init_account(master, admin, amax_token, amax_mtoken, "u3")
         # u4 = self.init_account(master, admin, amax_token, amax_mtoken, "u4")
         
@@ -78,16 +89,77 @@ class Test(unittest.TestCase):
         # orderbookdex.push_action("neworder", ["u1", 1, "buy", "0.01000000  METH","0.01000000  METH", "100.000000 MUSDT", 2, None ], u1)
         # table_gloab = orderbookdex.table("queue", "orderbookdex")
         
+        # the old clients do not send time_in_force, the order is gtc
         dex.neworder("seller", 1, "sell", "0.01000000  METH","300.000000 MUSDT", 3, None, seller)
         seller.transfer(dex, "0.01000000  METH", "")
         time.sleep(1)
         
-        dex.neworder("buyer", 1, "buy", "0.01000000  METH", "400.000000 MUSDT", 2, None, buyer)
+        dex.neworder("buyer", 1, "buy", "0.01000000  METH", "400.000000 MUSDT", 2, None, "gtc", buyer)
         buyer.transfer(dex, "4.000000 MUSDT", "")
         time.sleep(1)
         
   
         
+        COMMENT('''
+         time in force: the immediate orders match at once as transient takers
+        ''')
+        # post-only rests in the order book when it does not cross
+        seller.transfer(dex, "0.01000000 METH", "order:1:sell:0.01000000 METH:300.000000 MUSDT:11:postonly")
+        time.sleep(1)
+        # post-only fails when it would match at once
+        with self.assertRaises(Exception):
+            buyer.transfer(dex, "3.000000 MUSDT", "order:1:buy:0.01000000 METH:300.000000 MUSDT:12:postonly")
+        time.sleep(1)
+        # fill-or-kill fails when it can not be fully matched
+        with self.assertRaises(Exception):
+            buyer.transfer(dex, "6.000000 MUSDT", "order:1:buy:0.02000000 METH:300.000000 MUSDT:13:fok")
+        time.sleep(1)
+        # immediate-or-cancel matches the resting sell order, the unmatched funds are refunded and nothing rests
+        buyer_coins = self.get_balance(amax_mtoken, buyer, "MUSDT")
+        deal_count = len(self.get_rows(dex, "packeddeals", dex))
+        buyer.transfer(dex, "6.000000 MUSDT", "order:1:buy:0.02000000 METH:300.000000 MUSDT:14:ioc")
+        time.sleep(1)
+        self.assertAlmostEqual(buyer_coins - self.get_balance(amax_mtoken, buyer, "MUSDT"), 3.0)
+        self.assertEqual(len(self.get_rows(dex, "packeddeals", dex)), deal_count + 1)
+        self.assertEqual(self.find_order(dex, 1, "buy", "buyer", 14), None)
+        # fill-or-kill is matched when it can be fully filled
+        seller.transfer(dex, "0.01000000 METH", "order:1:sell:0.01000000 METH:300.000000 MUSDT:15")
+        time.sleep(1)
+        buyer.transfer(dex, "3.000000 MUSDT", "order:1:buy:0.01000000 METH:300.000000 MUSDT:16:fok")
+        time.sleep(1)
+        self.assertEqual(len(self.get_rows(dex, "packeddeals", dex)), deal_count + 2)
+        self.assertEqual(self.find_order(dex, 1, "sell", "seller", 15), None)
+        self.assertEqual(self.find_order(dex, 1, "buy", "buyer", 16), None)
+
+        COMMENT('''
+         entry taker only: the new order only matches the opposite side as taker
+        ''')
+        self.set_entry_taker_only(dex, True)
+        seller.transfer(dex, "0.01000000 METH", "order:1:sell:0.01000000 METH:300.000000 MUSDT:21")
+        time.sleep(1)
+        # the partly matched buy order rests in the order book after matching as taker
+        buyer.transfer(dex, "6.000000 MUSDT", "order:1:buy:0.02000000 METH:300.000000 MUSDT:22")
+        time.sleep(1)
+        dex.cancelall("buyer", None, buyer)
+        time.sleep(1)
+        self.set_entry_taker_only(dex, False)
+
+        COMMENT('''
+         market buy: the budget is spent over the sell orders at odd prices
+        ''')
+        seller.transfer(dex, "0.10000000 METH", "order:1:sell:0.10000000 METH:17.994247 MUSDT:31")
+        seller.transfer(dex, "0.50000000 METH", "order:1:sell:0.50000000 METH:18.000001 MUSDT:32")
+        time.sleep(1)
+        # fills the first order, then the budget left is spent on part of the second order
+        buyer.transfer(dex, "4.724149 MUSDT", "market:1:buy:33")
+        time.sleep(1)
+        dex.cancelall("seller", None, seller)
+        time.sleep(1)
+
+        self.amend_order(dex, amax_mtoken, buyer)
+
+        self.match_many_pairs(dex, dexadmin, buyer, seller)
+
         # dex.withdraw("dexadmin", "amax.mtoken", "0.00003000 METH", None, dexadmin)
         # dex.withdraw("dexadmin", "amax.mtoken", "0.008986 MUSDT", None, dexadmin)
         # dex.withdraw("sellerp1", "amax.mtoken", "0.000001 MUSDT", None, sellerp1)
@@ -134,9 +206,208 @@ class Test(unittest.TestCase):
         ''')
         time.sleep(1)
         
+    def migrate_legacy_orders(self, dex, dex_path, dexadmin, buyer, seller):
+        if not DEX_LEGACY_PATH:
+            return
+        COMMENT('''
+         migrate orders: the orders placed by the deployed release are moved to the packed table and counted in depth
+        ''')
+        Contract(dex, DEX_LEGACY_PATH).deploy()
+        dex.neworder("buyer", 1, "buy", "0.01000000 METH", "200.000000 MUSDT", 1, None, buyer)
+        buyer.transfer(dex, "2.000000 MUSDT", "")
+        dex.neworder("seller", 1, "sell", "0.01000000 METH", "300.000000 MUSDT", 2, None, seller)
+        seller.transfer(dex, "0.01000000 METH", "")
+        # the queued order is left unfunded in the legacy queue
+        dex.neworder("buyer", 1, "buy", "0.01000000 METH", "100.000000 MUSDT", 3, None, buyer)
+        time.sleep(1)
+
+        Contract(dex, dex_path).deploy()
+        dex.migratequeue(10, dexadmin)
+        dex.migrateorder(1, 10, dexadmin)
+        time.sleep(1)
+        queue = self.get_rows(dex, "queue", dex)
+        self.assertEqual([(row["owner"], row["ext_id"], row["time_in_force"]) for row in queue], [("buyer", 3, "gtc")])
+        dex.delqueueord("buyer", 0, buyer)
+        time.sleep(1)
+        self.assertEqual(self.get_rows(dex, "queue", dex), [])
+        self.assertEqual(self.get_rows(dex, "order", self.get_book_scope(1, "buy")), [])
+        self.assertEqual(self.get_rows(dex, "order", self.get_book_scope(1, "sell")), [])
+        self.check_depth(dex, 1, "buy", {"200.000000 MUSDT": ("0.01000000 METH", 1)})
+        self.check_depth(dex, 1, "sell", {"300.000000 MUSDT": ("0.01000000 METH", 1)})
+
+        # the cancel takes the migrated order out of depth
+        buy_order = self.get_rows(dex, "orders", self.get_book_scope(1, "buy"))[0]
+        dex.cancel(1, "buy", int(buy_order["order_id"]), buyer)
+        time.sleep(1)
+        self.check_depth(dex, 1, "buy", {})
+        self.check_depth(dex, 1, "sell", {"300.000000 MUSDT": ("0.01000000 METH", 1)})
+        dex.cancelall("seller", 1, seller)
+        time.sleep(1)
+        self.check_depth(dex, 1, "sell", {})
+
+    def amend_order(self, dex, amax_mtoken, buyer):
+        COMMENT('''
+         amend: the released funds are refunded, the more frozen funds are paid by transfer with amend memo
+        ''')
+        buyer.transfer(dex, "2.000000 MUSDT", "order:1:buy:0.02000000 METH:100.000000 MUSDT:41")
+        time.sleep(1)
+        order = self.find_order(dex, 1, "buy", "buyer", 41)
+        order_id = int(order["order_id"])
+        self.check_depth(dex, 1, "buy", {"100.000000 MUSDT": ("0.02000000 METH", 1)})
+
+        # shrink in place, the order keeps its id
+        buyer_coins = self.get_balance(amax_mtoken, buyer, "MUSDT")
+        dex.amend("buyer", 1, "buy", order_id, "0.01000000 METH", "100.000000 MUSDT", buyer)
+        time.sleep(1)
+        order = self.find_order(dex, 1, "buy", "buyer", 41)
+        self.assertEqual(int(order["order_id"]), order_id)
+        self.assertEqual(int(order["total_asset_amount"]), 1000000)
+        self.assertEqual(int(order["total_frozen_amount"]), 1000000)
+        self.assertAlmostEqual(self.get_balance(amax_mtoken, buyer, "MUSDT") - buyer_coins, 1.0)
+        self.check_depth(dex, 1, "buy", {"100.000000 MUSDT": ("0.01000000 METH", 1)})
+
+        # the new price moves the order to the new level with a new id
+        buyer_coins = self.get_balance(amax_mtoken, buyer, "MUSDT")
+        dex.amend("buyer", 1, "buy", order_id, "0.01000000 METH", "50.000000 MUSDT", buyer)
+        time.sleep(1)
+        order = self.find_order(dex, 1, "buy", "buyer", 41)
+        self.assertNotEqual(int(order["order_id"]), order_id)
+        self.assertEqual(int(order["price"]), 50000000)
+        self.assertEqual(int(order["total_frozen_amount"]), 500000)
+        self.assertAlmostEqual(self.get_balance(amax_mtoken, buyer, "MUSDT") - buyer_coins, 0.5)
+        self.check_depth(dex, 1, "buy", {"50.000000 MUSDT": ("0.01000000 METH", 1)})
+        order_id = int(order["order_id"])
+
+        # more frozen funds must be paid by transfer
+        with self.assertRaises(Exception):
+            dex.amend("buyer", 1, "buy", order_id, "0.02000000 METH", "100.000000 MUSDT", buyer)
+        buyer_coins = self.get_balance(amax_mtoken, buyer, "MUSDT")
+        buyer.transfer(dex, "1.500000 MUSDT", "amend:1:buy:" + str(order_id) + ":0.02000000 METH:100.000000 MUSDT")
+        time.sleep(1)
+        order = self.find_order(dex, 1, "buy", "buyer", 41)
+        self.assertEqual(int(order["total_asset_amount"]), 2000000)
+        self.assertEqual(int(order["total_frozen_amount"]), 2000000)
+        self.assertAlmostEqual(buyer_coins - self.get_balance(amax_mtoken, buyer, "MUSDT"), 1.5)
+        self.check_depth(dex, 1, "buy", {"100.000000 MUSDT": ("0.02000000 METH", 1)})
+
+        dex.cancelall("buyer", 1, buyer)
+        time.sleep(1)
+        self.check_depth(dex, 1, "buy", {})
+
+    def match_many_pairs(self, dex, dexadmin, buyer, seller):
+        COMMENT('''
+         matchmany: the budget is shared by the crossed pairs, the cursor of each pair resumes the run
+        ''')
+        dex.setsympair(["8,MBTC", "amax.mtoken"], ["6,MUSDT", "amax.mtoken"], "0.01000000 MBTC", "1.000000 MUSDT", True, dexadmin)
+        dex.setsympair(["8,AMAX", "amax.token"], ["6,MUSDT", "amax.mtoken"], "0.01000000 AMAX", "1.000000 MUSDT", True, dexadmin)
+        # the new buy order only matches one sell order at once, the other two rest crossed
+        self.set_config(dex, max_match_count=1)
+        pairs = {1: "METH", 2: "MBTC", 3: "AMAX"}
+        for pair_id, asset_code in pairs.items():
+            for ext_id in (50, 51, 52):
+                seller.transfer(dex, "0.01000000 " + asset_code,
+                                "order:%d:sell:0.01000000 %s:100.000000 MUSDT:%d" % (pair_id, asset_code, ext_id))
+            buyer.transfer(dex, "3.000000 MUSDT", "order:%d:buy:0.03000000 %s:100.000000 MUSDT:53" % (pair_id, asset_code))
+        time.sleep(1)
+        self.set_config(dex, max_match_count=50)
+
+        with self.assertRaises(Exception):
+            dex.matchmany("dexadmin", [], 10, "", dexadmin)
+        with self.assertRaises(Exception):
+            dex.matchmany("dexadmin", list(range(1, 102)), 10, "", dexadmin)
+
+        # one match of each pair, every run is left pending
+        deals = self.get_pair_deal_counts(dex)
+        dex.matchmany("dexadmin", list(pairs.keys()), 3, "", dexadmin)
+        time.sleep(1)
+        cursors = self.get_match_cursors(dex)
+        new_deals = self.get_pair_deal_counts(dex)
+        for pair_id in pairs:
+            self.assertEqual(new_deals.get(pair_id, 0), deals.get(pair_id, 0) + 1)
+            self.assertTrue(cursors[pair_id]["pending"])
+            self.assertEqual(cursors[pair_id]["run_matched_count"], 1)
+            self.assertEqual(cursors[pair_id]["run_match_times"], 1)
+
+        # the next call resumes the runs and finishes them
+        dex.matchmany("dexadmin", list(pairs.keys()), 10, "", dexadmin)
+        time.sleep(1)
+        last_cursors, cursors = cursors, self.get_match_cursors(dex)
+        new_deals = self.get_pair_deal_counts(dex)
+        for pair_id in pairs:
+            self.assertEqual(new_deals.get(pair_id, 0), deals.get(pair_id, 0) + 2)
+            self.assertFalse(cursors[pair_id]["pending"])
+            self.assertEqual(cursors[pair_id]["run_matched_count"], 2)
+            self.assertEqual(cursors[pair_id]["run_match_times"], 2)
+            self.assertGreater(int(cursors[pair_id]["last_deal_id"]), int(last_cursors[pair_id]["last_deal_id"]))
+            self.assertEqual(self.find_order(dex, pair_id, "buy", "buyer", 53), None)
+
+        # no pair is crossed any more
+        with self.assertRaises(Exception):
+            dex.matchmany("dexadmin", list(pairs.keys()), 10, "", dexadmin)
+
+    def get_pair_deal_counts(self, dex):
+        counts = {}
+        for row in self.get_rows(dex, "packeddeals", dex):
+            pair_id = int(row["sympair_id"])
+            counts[pair_id] = counts.get(pair_id, 0) + 1
+        return counts
+
+    def get_match_cursors(self, dex):
+        return {int(row["sympair_id"]): row for row in self.get_rows(dex, "matchcursor", dex)}
+
+    def get_book_scope(self, sympair_id, side):
+        return str(sympair_id * 10000 + (1 if side == "buy" else 2))
+
+    def get_rows(self, dex, table, scope):
+        return dex.table(table, scope, limit=1000).json["rows"]
+
+    def find_order(self, dex, sympair_id, side, owner, ext_id):
+        for row in self.get_rows(dex, "orders", self.get_book_scope(sympair_id, side)):
+            if row["owner"] == owner and int(row["ext_id"]) == ext_id:
+                return row
+        return None
+
+    def get_balance(self, token, user, symbol_code):
+        for row in self.get_rows(token, "accounts", user):
+            amount, code = row["balance"].split()
+            if code == symbol_code:
+                return float(amount)
+        return 0.0
+
+    # expected: {price: (quantity, order_count)}
+    def check_depth(self, dex, sympair_id, side, expected):
+        rows = self.get_rows(dex, "depth", self.get_book_scope(sympair_id, side))
+        self.assertEqual({row["price"]: (row["quantity"], row["order_count"]) for row in rows}, expected)
+
+    def set_entry_taker_only(self, dex, entry_taker_only):
+        self.set_config(dex, entry_taker_only=entry_taker_only)
+
+    def set_config(self, dex, **changes):
+        conf = {
+            "dex_enabled": True,
+            "dex_admin": "dexadmin",
+            "dex_fee_collector": "dexadmin",
+            "maker_fee_ratio": 4,
+            "taker_fee_ratio": 8,
+            "max_match_count": 50,
+            "admin_sign_required": False,
+            "support_quote_symbols": [{"sym": "6,MUSDT", "contract": "amax.mtoken"}],
+            "parent_reward_ratio": 10,
+            "grand_reward_ratio": 5,
+            "apl_farm_id": 0,
+            "farm_scales": [],
+            "balance_log_mode": "full",
+            "balance_log_size": 0,
+            "deal_retain_count": 0,
+            "deal_retain_secs": 0,
+            "entry_taker_only": False
+        }
+        conf.update(changes)
+        dex.setconfig(conf, dex)
+
     def init_buyer_account(self, p1, admin, amax_token, amax_mtoken, user):
         a = new_account(p1, user)
-        admin.transfer(a, "20.000000 MUSDT", "")
+        admin.transfer(a, "50.000000 MUSDT", "")
         return a
     
     def init_seller_account(self, p1, admin, amax_token, amax_mtoken, user):